@@ -6,8 +6,287 @@
 struct rate_limit {
     __u64 byte_rate;
     __u64 packet_rate;
+    /*
+        Credit which may be accumulated while the cgroup is idle and
+        then be sent without pacing. 0 means pure pacing, or a bucket
+        of RATE_LIMIT_DEFAULT_POLICE_BURST_NS when packets are policed
+        instead of paced.
+    */
+    __u64 burst_bytes;
+    __u64 burst_packets;
+    /*
+        Packets which would be delayed by more than drop_horizon_ns are
+        dropped, 0 means RATE_LIMIT_DEFAULT_HORIZON_NS. ECN capable
+        packets delayed by more than ecn_threshold_ns are marked CE,
+        0 disables marking.
+    */
+    __u64 drop_horizon_ns;
+    __u64 ecn_threshold_ns;
+    /*
+        Pure TCP control packets (ACK, SYN, FIN, RST without payload)
+        bypass the budget and are paced at this rate instead. 0 treats
+        them like other packets, RATE_UNLIMITED does not pace them.
+    */
+    __u64 ctrl_packet_rate;
+    /*
+        While borrowing pool pool_id has idle capacity, byte_rate is
+        only guaranteed and the cgroup may send at up to ceil_byte_rate.
+        Pool 0 or a ceil_byte_rate not above byte_rate disables
+        borrowing.
+    */
+    __u64 ceil_byte_rate;
+    __u64 pool_id;
+    /*
+        Once quota_bytes have been sent, byte_rate is replaced with
+        post_quota_byte_rate, 0 then blocks the cgroup. A quota_bytes
+        of 0 means no quota.
+    */
+    __u64 quota_bytes;
+    __u64 post_quota_byte_rate;
+    /*
+        Traffic received by the sockets of the cgroup is policed at
+        ingress_byte_rate with a bucket of ingress_burst_bytes, 0 meaning
+        RATE_LIMIT_DEFAULT_POLICE_BURST_NS worth of the rate. An
+        ingress_byte_rate of 0 or RATE_UNLIMITED does not police.
+    */
+    __u64 ingress_byte_rate;
+    __u64 ingress_burst_bytes;
+    __u64 flags;
 };
 
 #define RATE_UNLIMITED (~(__u64)0)
 
+#define RATE_LIMIT_DEFAULT_HORIZON_NS (2 * 1000000000ull)
+/* fq drops packets more than 10s ahead by default */
+#define RATE_LIMIT_MAX_HORIZON_NS (10 * 1000000000ull)
+/* Packets of credit accumulated by the control budget */
+#define RATE_LIMIT_CTRL_BURST 16
+/*
+    Policed packets, received or sent in police mode, are dropped and
+    not delayed, so the bucket needs some depth for TCP to get through
+*/
+#define RATE_LIMIT_DEFAULT_POLICE_BURST_NS (10 * 1000000ull)
+#define RATE_LIMIT_MIN_POLICE_BURST 65536
+/* Bounds of the receive window clamp of a connection */
+#define RATE_LIMIT_MIN_RX_WINDOW 4096
+#define RATE_LIMIT_MAX_RX_WINDOW (1 << 30)
+/*
+    Limits of ancestor cgroups are only looked up on the first levels
+    of the hierarchy, the root being level 0
+*/
+#define RATE_LIMIT_MAX_LEVELS 16
+/* Borrowing pools are numbered from 1 */
+#define RATE_LIMIT_MAX_POOLS 16
+#define RATE_LIMIT_MAX_IFACES 64
+/* Number of sub-buckets flows are hashed into, a power of 2 */
+#define RATE_LIMIT_FLOW_BUCKETS 16
+
+/*
+    Fixed-point reciprocal of a rate: (units * mult) >> shift is the
+    time in ns needed to send units. mult is 0 for RATE_UNLIMITED.
+*/
+struct rate_limit_recip {
+    __u64 mult;
+    __u32 shift;
+    __u32 reserved;
+};
+
+/* Parameters derived from struct rate_limit by the daemon */
+struct rate_limit_params {
+    struct rate_limit_recip ns_per_byte;
+    struct rate_limit_recip ns_per_pkt;
+    struct rate_limit_recip ns_per_ctrl_pkt;
+    struct rate_limit_recip ns_per_ceil_byte;
+    struct rate_limit_recip ns_per_post_quota_byte;
+    struct rate_limit_recip ns_per_ingress_byte;
+    /* Time needed to send the burst, the bound of accumulated credit */
+    __u64 burst_ns;
+    __u64 horizon_ns;
+    /* RATE_UNLIMITED if marking is disabled */
+    __u64 ecn_threshold_ns;
+    __u64 ingress_burst_ns;
+};
+
+/* Value of rate_limit_map */
+struct rate_limit_cfg {
+    struct rate_limit limit;
+    struct rate_limit_params params;
+};
+
+/* Pacing state of a cgroup, written by the BPF program */
+struct rate_limit_priv {
+    __u64 next_avail_ts;
+    __u64 ctrl_next_avail_ts;
+    __u64 flow_next_avail_ts[RATE_LIMIT_FLOW_BUCKETS];
+    __u64 ingress_next_avail_ts;
+};
+
+/*
+    Capacity shared by the cgroups borrowing from a pool, both the
+    guaranteed and the borrowed traffic of its members is charged
+*/
+struct rate_limit_pool {
+    /* 0 if the pool is not configured */
+    __u64 byte_rate;
+    struct rate_limit_recip ns_per_byte;
+    /* Written by the BPF program */
+    __u64 next_avail_ts;
+};
+
+/*
+    Bucket 0 of the delay histogram counts delays below 1us, bucket n
+    those in [2^(n-1), 2^n) us, the last one also everything above.
+*/
+#define RATE_LIMIT_DELAY_BUCKETS 26
+
+/*
+    Counters of a limited cgroup, kept per CPU by the BPF program. Bytes
+    are counted as on the wire, packets as GSO segments.
+*/
+struct rate_limit_stats {
+    __u64 passed_bytes;
+    __u64 passed_packets;
+    /* Passed packets which were given a later departure time */
+    __u64 delayed_packets;
+    /* Passed packets which were marked CE */
+    __u64 marked_packets;
+    __u64 dropped_bytes;
+    __u64 dropped_packets;
+    /* Delay imposed on passed packets, one count per skb */
+    __u64 max_delay_ns;
+    __u64 delay_hist[RATE_LIMIT_DELAY_BUCKETS];
+    /* Received traffic, only counted while ingress_byte_rate polices it */
+    __u64 ingress_passed_bytes;
+    __u64 ingress_passed_packets;
+    __u64 ingress_dropped_bytes;
+    __u64 ingress_dropped_packets;
+    /* Rate limiting of drop events on this CPU, not counters */
+    __u64 next_event_ts;
+    __u64 suppressed_drops;
+};
+
+/* At most one drop event per cgroup and CPU in this interval */
+#define RATE_LIMIT_EVENT_INTERVAL_NS (10 * 1000000ull)
+
+/*
+    Link-layer framing of an interface, like the overhead and
+    mpu of sch_cake, so that byte rates are charged as on the wire.
+*/
+struct rate_limit_iface {
+    /* Added to the length of each segment, may be negative */
+    __s32 overhead;
+    /* Least length charged for a segment, after the overhead */
+    __u32 mpu;
+};
+
+/*
+    Parts of the datapath which the daemon can compile out before
+    loading, so that they cost nothing per packet.
+*/
+enum {
+    RATE_LIMIT_FEAT_BYTE_RATE = 1 << 0,
+    RATE_LIMIT_FEAT_PACKET_RATE = 1 << 1,
+    RATE_LIMIT_FEAT_BURST = 1 << 2,
+    /* Counters, delay histograms and drop events */
+    RATE_LIMIT_FEAT_STATS = 1 << 3,
+    RATE_LIMIT_FEAT_ECN = 1 << 4,
+    RATE_LIMIT_FEAT_CTRL = 1 << 5,
+    RATE_LIMIT_FEAT_QUOTA = 1 << 6,
+    RATE_LIMIT_FEAT_BORROW = 1 << 7,
+    RATE_LIMIT_FEAT_FLOW_FAIR = 1 << 8,
+    RATE_LIMIT_FEAT_PERCPU = 1 << 9,
+    RATE_LIMIT_FEAT_OVERHEAD = 1 << 10,
+    /* Policing on clsact ingress, only with the tc attach mode */
+    RATE_LIMIT_FEAT_INGRESS = 1 << 11,
+    /* sock_ops program clamping receive windows, outside of the datapath */
+    RATE_LIMIT_FEAT_RX_WINDOW = 1 << 12,
+    RATE_LIMIT_FEAT_ALL = (1 << 13) - 1,
+};
+
+enum {
+    /* Zero rate */
+    RATE_LIMIT_DROP_BLOCKED,
+    /* Quota used up with a post-quota rate of 0 */
+    RATE_LIMIT_DROP_QUOTA,
+    /* Would be delayed past the horizon */
+    RATE_LIMIT_DROP_HORIZON,
+    /* Received beyond the ingress bucket */
+    RATE_LIMIT_DROP_INGRESS,
+};
+
+/* Sent through rate_limit_events, for sampled drops */
+struct rate_limit_drop_event {
+    __u64 cgroup_id;
+    /* How far past the horizon the packet would have departed */
+    __u64 lateness_ns;
+    /* Drops not reported since the last event of the cgroup on this CPU */
+    __u64 nr_suppressed;
+    __u32 len;
+    /* Ethertype in host byte order */
+    __u16 protocol;
+    __u8 l4_proto;
+    __u8 reason;
+};
+
+/*
+    Value of the cgroup local storage: config and pacing state together,
+    so that a packet needs a single lookup. The daemon writes a new
+    config into the slot not in use and then switches to it, the pacing
+    state is only written by the BPF program.
+*/
+struct rate_limit_storage {
+    struct rate_limit_priv priv;
+    /* 1 + index of the config in use, 0 until the first is written */
+    __u32 cfg_active;
+    __u32 pad;
+    struct rate_limit_cfg cfg[2];
+};
+
+enum {
+    /* Split the budget into per-CPU slices, rebalanced by the daemon */
+    RATE_LIMIT_F_PERCPU = 1 << 0,
+    /*
+        Share the budget fairly among the active flows of the cgroup,
+        takes precedence over RATE_LIMIT_F_PERCPU
+    */
+    RATE_LIMIT_F_FLOW_FAIR = 1 << 1,
+    /*
+        Enforce ingress_byte_rate by clamping the TCP receive windows of
+        the cgroup instead of policing, only for the cgroup of a task
+    */
+    RATE_LIMIT_F_RX_WINDOW = 1 << 2,
+};
+
+/*
+    Value of the cgroup storage of the sock_ops program, attached to
+    each cgroup limited with RATE_LIMIT_F_RX_WINDOW
+*/
+struct rate_limit_rx_window {
+    /* Written by the daemon */
+    __u64 byte_rate;
+    /* The cgroup, key of its connection count in rate_limit_rx_conns_map */
+    __u64 cgroup_id;
+};
+
+/*
+    Share of one CPU in the budget of a cgroup in RATE_LIMIT_F_PERCPU
+    mode, written by the daemon.
+*/
+struct rate_limit_share {
+    /* Reciprocal of the share, in RATE_LIMIT_SHARE_SHIFT fixed point */
+    __u64 delay_scale;
+    /* charged_ns of the shard when the share was computed */
+    __u64 charged_snapshot;
+};
+
+/* Pacing state of one CPU, written by the BPF program */
+struct rate_limit_shard {
+    __u64 next_avail_ts;
+    /* Total unscaled delay charged on this CPU */
+    __u64 charged_ns;
+};
+
+#define RATE_LIMIT_SHARE_SHIFT 16
+#define RATE_LIMIT_SHARE_ONE (1ull << RATE_LIMIT_SHARE_SHIFT)
+
 #endif /* defined(TRAFFIC_LIMITD_BPF_PROTOCOL_H) */
@@ -3,5 +3,9 @@
 
 int cg_find_unified(void);
 int cg_path_get_cgroupid(const char *path, uint64_t *ret);
+int cg_id_open(uint64_t id);
+int cg_path_get_level(const char *path);
+int cg_root_open(void);
+int cg_self_open(void);
 
 #endif /* defined(CGROUP_UTIL_H) */
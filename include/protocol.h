@@ -13,6 +13,9 @@ struct rate_limit_msg {
         RATE_LIMIT_FAIL,
         RATE_LIMIT_LOG,
         RATE_LIMIT_PROCEED,
+        RATE_LIMIT_QUERY,
+        RATE_LIMIT_STATUS,
+        RATE_LIMIT_DATAPATH,
     } type;
     char attr[];
 };
@@ -26,6 +29,51 @@ enum {
     RATE_LIMIT_REQ_NOWAIT = 1 << 0,
 };
 
+struct rate_limit_query_attr {
+    uint64_t flags;
+};
+
+enum {
+    /* All scopes of the user instead of the one of the querying process */
+    RATE_LIMIT_QUERY_ALL = 1 << 0,
+};
+
+#define RATE_LIMIT_SCOPE_NAME_MAX 128
+
+/* Features of the datapath, in struct rate_limit_datapath_attr */
+enum {
+    /* Attached to the root cgroup instead of to each interface */
+    RATE_LIMIT_DATAPATH_CGROUP_EGRESS = 1 << 0,
+    /* Dropping instead of delaying */
+    RATE_LIMIT_DATAPATH_POLICE = 1 << 1,
+    RATE_LIMIT_DATAPATH_TCX = 1 << 2,
+    RATE_LIMIT_DATAPATH_CGRP_STORAGE = 1 << 3,
+    RATE_LIMIT_DATAPATH_DROP_EVENTS = 1 << 4,
+    /* Policing received traffic on clsact ingress */
+    RATE_LIMIT_DATAPATH_INGRESS = 1 << 5,
+    /* Clamping the receive windows of TCP connections */
+    RATE_LIMIT_DATAPATH_RX_WINDOW = 1 << 6,
+};
+
+/* Sent before the status of the scopes */
+struct rate_limit_datapath_attr {
+    uint64_t features;
+};
+
+/*
+    Reply to RATE_LIMIT_QUERY, one for each scope, followed by
+    RATE_LIMIT_PROCEED
+*/
+struct rate_limit_status_attr {
+    char scope_name[RATE_LIMIT_SCOPE_NAME_MAX];
+    uint64_t cgroup_id;
+    struct rate_limit limit;
+    uint64_t sent_bytes;
+    struct rate_limit_stats stats;
+    uint64_t delay_p50_ns;
+    uint64_t delay_p99_ns;
+};
+
 struct rate_limit_fail_attr {
     enum {
         RATE_LIMIT_FAIL_UNKNOWN,
@@ -3,11 +3,44 @@
 
 #include <bpf_protocol.h>
 
+enum datapath_attach {
+    // clsact filter on each interface, paced by fq
+    DATAPATH_ATTACH_TC,
+    // BPF_CGROUP_INET_EGRESS of the root cgroup, paced by fq
+    DATAPATH_ATTACH_CGROUP,
+    // BPF_CGROUP_INET_EGRESS of the root cgroup, dropping instead of delaying
+    DATAPATH_ATTACH_CGROUP_POLICE,
+};
+
+// Limit of one cgroup in cgroup_rate_limit_set_many()
+struct rate_limit_update {
+    uint64_t cg_id;
+    int level;
+    struct rate_limit limit;
+};
+
+typedef void (*drop_event_handler_t)(const struct rate_limit_drop_event *event);
+
 int tc_setup_inferface(const char *ifnames);
-int open_and_load_bpf_obj(int max_tasks);
+int cgroup_attach_datapath(void);
+int open_and_load_bpf_obj(int max_tasks, enum datapath_attach mode, uint32_t disabled_features);
 int close_bpf_obj(void);
-int cgroup_rate_limit_set(uint64_t cg_id, const struct rate_limit *limit);
-int cgroup_rate_limit_unset(uint64_t cg_id);
+int cgroup_rate_limit_level(uint64_t cg_id, const char *path);
+int cgroup_rate_limit_set(uint64_t cg_id, int level, const struct rate_limit *limit);
+int cgroup_rate_limit_set_many(const struct rate_limit_update *updates, uint32_t nr);
+int cgroup_rate_limit_unset(uint64_t cg_id, int level);
+int cgroup_rate_limit_flush(void);
 int cgroup_rate_limit_check(uint64_t cg_id);
+int cgroup_rate_limit_stats(uint64_t cg_id, struct rate_limit_stats *total);
+uint64_t rate_limit_stats_delay_quantile(const struct rate_limit_stats *stats, unsigned int permille);
+int cgroup_rate_limit_query(uint64_t cg_id, struct rate_limit *limit, struct rate_limit_priv *priv);
+int cgroup_rate_limit_quota_used(uint64_t cg_id, uint64_t *sent_bytes);
+int cgroup_rate_limit_rebalance(void);
+uint32_t cgroup_rate_limit_nr_percpu(void);
+int cgroup_rate_limit_pool_set(uint32_t pool_id, uint64_t byte_rate);
+int cgroup_rate_limit_iface_set(const char *ifname, int32_t overhead, uint32_t mpu);
+uint64_t cgroup_rate_limit_datapath(void);
+int cgroup_rate_limit_events_open(drop_event_handler_t handler);
+int cgroup_rate_limit_events_consume(void);
 
 #endif /* defined(TCBPF_UTIL_H) */
@@ -5,7 +5,11 @@
 #include <linux/pkt_cls.h>
 #include <linux/if_ether.h>
 #include <asm-generic/errno.h>
+#include <linux/in.h>
+#include <linux/ip.h>
 #include <linux/ipv6.h>
+#include <linux/tcp.h>
+#include <linux/udp.h>
 
 #include <bpf_protocol.h>
 
@@ -16,6 +20,7 @@
 
 #undef __always_inline          /* stddef.h defines its own */
 #define __always_inline         inline __attribute__((always_inline))
+#define __noinline              __attribute__((noinline))
 
 // helper macros for branch prediction
 #define LIKELY(x)   __builtin_expect(!!(x), 1)
@@ -29,6 +34,10 @@
                          ##__VA_ARGS__);                \
 })
 
+#ifndef NULL
+# define NULL                   ((void *)0)
+#endif
+
 #ifndef memset
 # define memset(dest, chr, n)   __builtin_memset((dest), (chr), (n))
 #endif
@@ -43,70 +52,1132 @@
 
 #define NS_PER_SEC 1000000000ull
 
+// Return codes of BPF_CGROUP_INET_EGRESS, a drop also notifies the congestion control
+#define CGROUP_SKB_PASS 1
+#define CGROUP_SKB_DROP_CN 2
+
+// Fragment offset in iphdr.frag_off, not in the uapi headers
+#define IP_OFFSET 0x1fff
+
+// From asm/socket.h, which is not available to BPF
+#define SOL_SOCKET 1
+#define SO_RCVBUF 8
+
+#define USEC_PER_SEC 1000000ull
+
 #define MAP_MAX_LEN 1024
-#define DROP_HORIZON (2 * NS_PER_SEC)
+#define RESERVE_MAX_RETRY 8
 
 typedef __u64 time_ns_t, cgroup_id_t;
 
-struct rate_limit_priv {
-	time_ns_t next_avail_ts;
-};
+struct cgroup {
+	int level;
+} __attribute__((preserve_access_index));
+extern struct cgroup *bpf_cgroup_from_id(__u64 cgid) __ksym __weak;
+extern void bpf_cgroup_release(struct cgroup *cgrp) __ksym __weak;
 
-struct {
+/*
+	Bit n is set by the daemon if a cgroup on level n is limited, so
+	that ancestors are only looked up on those levels. Limits cover
+	the descendants of the cgroup.
+*/
+volatile __u32 rate_limit_level_mask = 0;
+// Cgroup whose level cgroup_rate_limit_level returns
+volatile __u64 rate_limit_level_cgid = 0;
+// Number of cgroups with an ingress limit, sockets are only looked up if any
+volatile __u32 rate_limit_nr_ingress = 0;
+// Local port of the connection cgroup_rate_limit_rx_probe tries, and its result
+volatile __u32 rate_limit_rx_probe_port = 0;
+volatile int rate_limit_rx_probe_rc = 0;
+// Config cgroup_rate_limit_cgrp_set writes, and the cgroup it writes it for
+struct rate_limit_cfg rate_limit_set_cfg;
+volatile __u64 rate_limit_set_cgid = 0;
+
+/*
+	Set by the daemon before loading when the program is attached to
+	BPF_CGROUP_INET_EGRESS of the root cgroup instead of to tc. With
+	rate_limit_police, the devices are not expected to honor
+	skb->tstamp, so packets beyond the burst are dropped instead of
+	delayed.
+*/
+const volatile int rate_limit_cgroup_egress = 0;
+const volatile int rate_limit_police = 0;
+// Cleared by the daemon when the kernel has no ring buffers
+const volatile int rate_limit_drop_events = 1;
+
+/*
+	RATE_LIMIT_FEAT_* flags, set by the daemon before loading. Known to
+	the verifier, so the code of a disabled feature is removed.
+*/
+const volatile __u32 rate_limit_features = RATE_LIMIT_FEAT_ALL;
+#define FEATURE(name) (rate_limit_features & RATE_LIMIT_FEAT_##name)
+
+/*
+	The config is kept in an inner map, which the daemon replaces as a
+	whole to grow it.
+*/
+struct rate_limit_cfg_map {
 	__uint(type, BPF_MAP_TYPE_HASH);
 	__type(key, cgroup_id_t);
-	__type(value, struct rate_limit);
+	__type(value, struct rate_limit_cfg);
 	__uint(max_entries, MAP_MAX_LEN);
 	__uint(map_flags, BPF_F_RDONLY_PROG);
+};
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY_OF_MAPS);
+	__type(key, __u32);
+	__uint(max_entries, 1);
+	__array(values, struct rate_limit_cfg_map);
 } rate_limit_map SEC(".maps");
 
+/*
+	The maps of per-cgroup state are sized by the daemon for the largest
+	config map and allocate their entries on use. Their entries are
+	deleted by the daemon with those of the config.
+*/
 struct {
-	__uint(type, BPF_MAP_TYPE_LRU_HASH);
+	__uint(type, BPF_MAP_TYPE_HASH);
 	__type(key, cgroup_id_t);
 	__type(value, struct rate_limit_priv);
 	__uint(max_entries, MAP_MAX_LEN);
+	__uint(map_flags, BPF_F_NO_PREALLOC);
 } rate_limit_priv_map SEC(".maps");
 
+struct {
+	__uint(type, BPF_MAP_TYPE_CGRP_STORAGE);
+	__uint(map_flags, BPF_F_NO_PREALLOC);
+	__type(key, int);
+	__type(value, struct rate_limit_storage);
+} rate_limit_cgrp_storage SEC(".maps");
+
+/*
+	Bytes sent by each cgroup with a quota, created by the daemon and
+	shared by the hash maps and cgroup local storage datapaths.
+*/
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__type(key, cgroup_id_t);
+	__type(value, __u64);
+	__uint(max_entries, MAP_MAX_LEN);
+	__uint(map_flags, BPF_F_NO_PREALLOC);
+} rate_limit_quota_map SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_HASH);
+	__type(key, cgroup_id_t);
+	__type(value, struct rate_limit_share);
+	__uint(max_entries, MAP_MAX_LEN);
+	__uint(map_flags, BPF_F_NO_PREALLOC | BPF_F_RDONLY_PROG);
+} rate_limit_share_map SEC(".maps");
 
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_HASH);
+	__type(key, cgroup_id_t);
+	__type(value, struct rate_limit_shard);
+	__uint(max_entries, MAP_MAX_LEN);
+	__uint(map_flags, BPF_F_NO_PREALLOC);
+} rate_limit_shard_map SEC(".maps");
 
-SEC("tc/cgroup_rate_limit")
-long cgroup_rate_limit(struct __sk_buff *skb){
-	const unsigned long long this_pkt_len = skb->len;
-	const unsigned long long cgid = bpf_skb_cgroup_id(skb);
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_HASH);
+	__type(key, cgroup_id_t);
+	__type(value, struct rate_limit_stats);
+	__uint(max_entries, MAP_MAX_LEN);
+	__uint(map_flags, BPF_F_NO_PREALLOC);
+} rate_limit_stats_map SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__type(key, __u32);
+	__type(value, struct rate_limit_iface);
+	__uint(max_entries, RATE_LIMIT_MAX_IFACES);
+	__uint(map_flags, BPF_F_RDONLY_PROG);
+} rate_limit_iface_map SEC(".maps");
+struct {
+	__uint(type, BPF_MAP_TYPE_RINGBUF);
+	__uint(max_entries, 256 * 1024);
+} rate_limit_events SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_CGROUP_STORAGE);
+	__type(key, struct bpf_cgroup_storage_key);
+	__type(value, struct rate_limit_rx_window);
+} rate_limit_rx_cgroup SEC(".maps");
+
+/*
+	Established TCP connections sharing the rate of each cgroup in
+	rate_limit_rx_cgroup, created by the daemon and counted by the BPF
+	program. Kept apart from the rate, which the daemon rewrites as a
+	whole. Signed, as connections counted before the cgroup was last
+	attached may close after.
+*/
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__type(key, cgroup_id_t);
+	__type(value, __s64);
+	__uint(max_entries, MAP_MAX_LEN);
+	__uint(map_flags, BPF_F_NO_PREALLOC);
+} rate_limit_rx_conns_map SEC(".maps");
+
+// Receive window clamp last set on a socket
+struct rate_limit_rx_sock {
+	__u32 window_clamp;
+};
+struct {
+	__uint(type, BPF_MAP_TYPE_SK_STORAGE);
+	__uint(map_flags, BPF_F_NO_PREALLOC);
+	__type(key, int);
+	__type(value, struct rate_limit_rx_sock);
+} rate_limit_rx_sock_map SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__type(key, __u32);
+	__type(value, struct rate_limit_pool);
+	__uint(max_entries, RATE_LIMIT_MAX_POOLS);
+} rate_limit_pool_map SEC(".maps");
+
+/*
+	Time needed to send units at the rate given by its reciprocal,
+	rounded to nearest.
+*/
+static __always_inline time_ns_t recip_delay_ns(__u64 units, const struct rate_limit_recip *recip){
+	return (units * recip->mult + ((1ull << recip->shift) >> 1)) >> recip->shift;
+}
+
+/*
+	Atomically reserve delay_ns on the timeline ending at *next_avail_ts,
+	starting no earlier than earliest_ts. The start of the reservation
+	is stored in *start_ts. Returns -1 if the reservation would start
+	after horizon_ts.
+*/
+static __always_inline int reserve_ts(volatile time_ns_t *next_avail_ts, time_ns_t earliest_ts, time_ns_t delay_ns, time_ns_t horizon_ts, time_ns_t *start_ts){
+	time_ns_t cur = *next_avail_ts;
+	for(int i = 0; i < RESERVE_MAX_RETRY; i++){
+		const time_ns_t start = cur > earliest_ts ? cur : earliest_ts;
+		if(start > horizon_ts){
+			*start_ts = start;
+			return -1;
+		}
+		const time_ns_t prev = __sync_val_compare_and_swap(next_avail_ts, cur, start + delay_ns);
+		if(prev == cur){
+			*start_ts = start;
+			return 0;
+		}
+		cur = prev;
+	}
+	/*
+		Heavily contended, fall back to fetch and add, which never loses
+		a reservation but does not return unused credit. Check the
+		horizon first, so a packet that would be dropped is not charged,
+		and lift a stale timeline to earliest_ts, so the reservation
+		ends after the start that is returned.
+	*/
+	if(cur < earliest_ts){
+		if(earliest_ts > horizon_ts){
+			*start_ts = earliest_ts;
+			return -1;
+		}
+		__sync_val_compare_and_swap(next_avail_ts, cur, earliest_ts);
+	}else if(cur > horizon_ts){
+		*start_ts = cur;
+		return -1;
+	}
+	const time_ns_t start = __sync_fetch_and_add(next_avail_ts, delay_ns);
+	if(start > horizon_ts){
+		// Overtaken past the horizon since the check, give the delay back
+		__sync_fetch_and_add(next_avail_ts, -delay_ns);
+		*start_ts = start;
+		return -1;
+	}
+	*start_ts = start > earliest_ts ? start : earliest_ts;
+	return 0;
+}
+
+/*
+	Scale a delay of the whole cgroup to the share of this CPU,
+	split to avoid overflowing the 64-bit product.
+*/
+static __always_inline time_ns_t scale_delay(time_ns_t delay_ns, __u64 delay_scale){
+	return (delay_ns >> RATE_LIMIT_SHARE_SHIFT) * delay_scale +
+		(((delay_ns & (RATE_LIMIT_SHARE_ONE - 1)) * delay_scale) >> RATE_LIMIT_SHARE_SHIFT);
+}
+
+/*
+	Reserve on the slice of the budget owned by this CPU, like
+	reserve_ts(). Delays are scaled by the share of the CPU, so the
+	burst window of the shard holds its share of the burst. At cgroup
+	egress the program runs preemptible in process context, where
+	another task may reserve on the same CPU, so the shard is updated
+	atomically too. Returns 1 if no share is configured yet.
+*/
+static __always_inline int reserve_percpu(cgroup_id_t cgid, time_ns_t earliest_ts, time_ns_t delay_ns, time_ns_t horizon_ts, time_ns_t *start_ts){
+	const struct rate_limit_share *share = bpf_map_lookup_elem(&rate_limit_share_map, &cgid);
+	if(!share){
+		return 1;
+	}
+	struct rate_limit_shard *shard = bpf_map_lookup_elem(&rate_limit_shard_map, &cgid);
+	if(!shard){
+		struct rate_limit_shard new_shard = {0};
+		bpf_map_update_elem(&rate_limit_shard_map, &cgid, &new_shard, BPF_NOEXIST);
+		shard = bpf_map_lookup_elem(&rate_limit_shard_map, &cgid);
+		if(!shard){
+			return 1;
+		}
+	}
+	if(reserve_ts(&shard->next_avail_ts, earliest_ts, scale_delay(delay_ns, share->delay_scale), horizon_ts, start_ts) < 0){
+		return -1;
+	}
+	__sync_fetch_and_add(&shard->charged_ns, delay_ns);
+	return 0;
+}
+
+/*
+	Reserve on the sub-bucket of the flow of skb. Each active flow is
+	charged nr_active times the delay, so that it gets its fair share
+	of the budget while flows which send little are not delayed behind
+	bulk ones. The reservation on the whole budget of the cgroup still
+	bounds the aggregate rate when the number of active flows changes.
+*/
+static __always_inline int reserve_flow(struct __sk_buff *skb, struct rate_limit_priv volatile *priv, time_ns_t now, time_ns_t earliest_ts, time_ns_t delay_ns, time_ns_t horizon_ts, time_ns_t *start_ts){
+	// The flow hash is not available at cgroup egress, where every packet has a socket
+	const __u32 hash = rate_limit_cgroup_egress ? (__u32)bpf_get_socket_cookie(skb) : bpf_get_hash_recalc(skb);
+	const __u32 flow = hash & (RATE_LIMIT_FLOW_BUCKETS - 1);
+	__u64 nr_active = 1;
+	for(__u32 i = 0; i < RATE_LIMIT_FLOW_BUCKETS; i++){
+		if(i != flow && priv->flow_next_avail_ts[i] > now){
+			nr_active++;
+		}
+	}
+	time_ns_t aggregate_start_ts;
+	if(reserve_ts(&priv->next_avail_ts, earliest_ts, delay_ns, horizon_ts, &aggregate_start_ts) < 0){
+		*start_ts = aggregate_start_ts;
+		return -1;
+	}
+	if(reserve_ts(&priv->flow_next_avail_ts[flow], earliest_ts, delay_ns * nr_active, horizon_ts, start_ts) < 0){
+		// The packet is dropped, give its reservation on the budget of the cgroup back
+		__sync_fetch_and_add(&priv->next_avail_ts, -delay_ns);
+		return -1;
+	}
+	// Depart once both the cgroup and the flow have room for it
+	if(aggregate_start_ts > *start_ts){
+		*start_ts = aggregate_start_ts;
+	}
+	return 0;
+}
+
+/*
+	Delay of len bytes of a cgroup borrowing from pool *pool: the delay
+	at the ceiling rate if the pool has idle capacity, so the cgroup
+	borrows it, or delay_ns otherwise. Staying on the one timeline of
+	the cgroup keeps its packets in order whichever rate they are paced
+	at. *pool is NULL if the pool is not configured.
+*/
+static __always_inline time_ns_t borrow_delay(const struct rate_limit_cfg *cfg, __u64 len, time_ns_t delay_ns, time_ns_t delay_ns_pkt, time_ns_t now, struct rate_limit_pool **pool){
+	const __u32 pool_id = cfg->limit.pool_id;
+	*pool = bpf_map_lookup_elem(&rate_limit_pool_map, &pool_id);
+	if(!*pool || (*pool)->byte_rate == 0){
+		*pool = NULL;
+		return delay_ns;
+	}
+	if((*pool)->next_avail_ts > now){
+		return delay_ns;
+	}
+	const time_ns_t delay_ns_ceil = recip_delay_ns(len, &cfg->params.ns_per_ceil_byte);
+	return delay_ns_pkt > delay_ns_ceil ? delay_ns_pkt : delay_ns_ceil;
+}
+
+/*
+	Charge len bytes of a packet which passed to its pool, whether it
+	was borrowed or guaranteed. Like the timeline of a cgroup, that of
+	the pool ends at most horizon_ts away, so that it does not run
+	ahead without bound while the members send beyond its capacity.
+*/
+static __always_inline void pool_charge(struct rate_limit_pool *pool, __u64 len, time_ns_t now, time_ns_t horizon_ts){
+	time_ns_t start_ts;
+	reserve_ts(&pool->next_avail_ts, now, recip_delay_ns(len, &pool->ns_per_byte), horizon_ts, &start_ts);
+}
+
+struct pkt_hdrs {
+	__u32 l3_len;
+	__u32 l4_len;
+	// Length of the network layer packet as told by its header
+	__u32 l3_tot_len;
+	__u8 l4_proto;
+};
+
+/*
+	Parse the network and transport headers. Fields which cannot be
+	parsed are left untouched.
+*/
+static __always_inline void parse_hdrs(struct __sk_buff *skb, struct pkt_hdrs *hdrs){
+	if(skb->protocol == bpf_htons(ETH_P_IP)){
+		struct iphdr iph;
+		if(bpf_skb_load_bytes_relative(skb, 0, &iph, sizeof(iph), BPF_HDR_START_NET) < 0){
+			return;
+		}
+		hdrs->l3_len = iph.ihl * 4;
+		hdrs->l3_tot_len = bpf_ntohs(iph.tot_len);
+		hdrs->l4_proto = iph.protocol;
+	}else if(skb->protocol == bpf_htons(ETH_P_IPV6)){
+		struct ipv6hdr ip6h;
+		if(bpf_skb_load_bytes_relative(skb, 0, &ip6h, sizeof(ip6h), BPF_HDR_START_NET) < 0){
+			return;
+		}
+		hdrs->l3_len = sizeof(ip6h);
+		hdrs->l3_tot_len = sizeof(ip6h) + bpf_ntohs(ip6h.payload_len);
+		hdrs->l4_proto = ip6h.nexthdr;
+	}else{
+		return;
+	}
+	if(hdrs->l4_proto == IPPROTO_TCP){
+		struct tcphdr tcph;
+		if(bpf_skb_load_bytes_relative(skb, hdrs->l3_len, &tcph, sizeof(tcph), BPF_HDR_START_NET) < 0){
+			return;
+		}
+		hdrs->l4_len = tcph.doff * 4;
+	}else if(hdrs->l4_proto == IPPROTO_UDP){
+		hdrs->l4_len = sizeof(struct udphdr);
+	}
+}
 
-	const struct rate_limit * const rlcf = bpf_map_lookup_elem(&rate_limit_map, &cgid);
-	if (!rlcf){
+/*
+	Length of len bytes in nr_segs segments on the wire of the
+	interface of skb.
+*/
+static __always_inline __u64 wire_len(struct __sk_buff *skb, __u64 len, __u64 nr_segs){
+	const __u32 ifindex = skb->ifindex;
+	const struct rate_limit_iface *iface = bpf_map_lookup_elem(&rate_limit_iface_map, &ifindex);
+	if(!iface){
+		return len;
+	}
+	__s64 wire = (__s64)len + (__s64)nr_segs * iface->overhead;
+	const __s64 min_wire = nr_segs * iface->mpu;
+	return wire > min_wire ? wire : min_wire;
+}
+
+/*
+	TCP segments without payload: pure ACKs, SYNs, FINs and RSTs.
+*/
+static __always_inline int is_tcp_control(const struct pkt_hdrs *hdrs){
+	return hdrs->l4_proto == IPPROTO_TCP && hdrs->l4_len != 0 &&
+		hdrs->l3_tot_len == hdrs->l3_len + hdrs->l4_len;
+}
+
+// How far ahead packets may be scheduled, nothing is delayed when policing
+static __always_inline time_ns_t horizon_ns(const struct rate_limit_cfg *cfg){
+	return rate_limit_police ? 0 : cfg->params.horizon_ns;
+}
+
+/*
+	Control packets bypass the budget of the cgroup so that its uplink
+	shaping does not starve the reverse direction, but are paced by a
+	separate small budget unless ctrl_packet_rate is RATE_UNLIMITED.
+*/
+static __always_inline long rate_limit_ctrl(struct __sk_buff *skb, const struct rate_limit_cfg *cfg, struct rate_limit_priv volatile *priv, time_ns_t now){
+	if(cfg->limit.ctrl_packet_rate == RATE_UNLIMITED){
 		return TC_ACT_OK;
 	}
-	if(rlcf->byte_rate == 0 || rlcf->packet_rate == 0){
+	const time_ns_t delay_ns = recip_delay_ns(1, &cfg->params.ns_per_ctrl_pkt);
+	const time_ns_t burst_ns = delay_ns * RATE_LIMIT_CTRL_BURST;
+	const time_ns_t earliest_ts = now > burst_ns ? now - burst_ns : 0;
+	time_ns_t start_ts;
+	if(reserve_ts(&priv->ctrl_next_avail_ts, earliest_ts, delay_ns, now + horizon_ns(cfg), &start_ts) < 0){
 		return TC_ACT_SHOT;
 	}
-	const time_ns_t delay_ns_byte = rlcf->byte_rate == RATE_UNLIMITED ? 0 : (this_pkt_len * NS_PER_SEC + rlcf->byte_rate / 2) / rlcf->byte_rate;
-	const time_ns_t delay_ns_pkt  = rlcf->packet_rate == RATE_UNLIMITED ? 0 : (NS_PER_SEC + rlcf->packet_rate / 2) / rlcf->packet_rate;
-	const time_ns_t delay_ns = delay_ns_pkt > delay_ns_byte ? delay_ns_pkt : delay_ns_byte;
+	if(start_ts > now && start_ts > skb->tstamp){
+		skb->tstamp = start_ts;
+	}
+	return TC_ACT_OK;
+}
+
+// Floor of log2(v), 0 for v == 0
+static __always_inline __u32 log2_u64(__u64 v){
+	__u32 r = 0, shift;
+	shift = (v > 0xffffffff) << 5; v >>= shift; r |= shift;
+	shift = (v > 0xffff) << 4; v >>= shift; r |= shift;
+	shift = (v > 0xff) << 3; v >>= shift; r |= shift;
+	shift = (v > 0xf) << 2; v >>= shift; r |= shift;
+	shift = (v > 0x3) << 1; v >>= shift; r |= shift;
+	return r | (v >> 1);
+}
+
+/*
+	Counters of the cgroup on this CPU, which need no atomics like the
+	shards.
+*/
+static __always_inline struct rate_limit_stats *stats_get(cgroup_id_t cgid){
+	struct rate_limit_stats *stats = bpf_map_lookup_elem(&rate_limit_stats_map, &cgid);
+	if(!stats){
+		const struct rate_limit_stats new_stats = {0};
+		bpf_map_update_elem(&rate_limit_stats_map, &cgid, &new_stats, BPF_NOEXIST);
+		stats = bpf_map_lookup_elem(&rate_limit_stats_map, &cgid);
+	}
+	return stats;
+}
+
+/*
+	Count a passed packet of nr_segs segments. The delay histogram takes
+	one increment per skb.
+*/
+static __always_inline long rate_limit_pass(cgroup_id_t cgid, __u64 len, __u64 nr_segs, time_ns_t delay_ns, int marked){
+	if(!FEATURE(STATS)){
+		return TC_ACT_OK;
+	}
+	struct rate_limit_stats *stats = stats_get(cgid);
+	if(!stats){
+		return TC_ACT_OK;
+	}
+	stats->passed_bytes += len;
+	stats->passed_packets += nr_segs;
+	__u32 bucket = 0;
+	if(delay_ns > 0){
+		stats->delayed_packets += nr_segs;
+		if(delay_ns > stats->max_delay_ns){
+			stats->max_delay_ns = delay_ns;
+		}
+		const __u64 delay_us = delay_ns / 1000;
+		if(delay_us > 0){
+			bucket = log2_u64(delay_us) + 1;
+		}
+		if(bucket >= RATE_LIMIT_DELAY_BUCKETS){
+			bucket = RATE_LIMIT_DELAY_BUCKETS - 1;
+		}
+	}
+	stats->delay_hist[bucket]++;
+	if(marked){
+		stats->marked_packets += nr_segs;
+	}
+	return TC_ACT_OK;
+}
+
+/*
+	Count a dropped packet and report it through rate_limit_events, at
+	most once per RATE_LIMIT_EVENT_INTERVAL_NS for the cgroup on this
+	CPU. Drops in between are only counted in the next event.
+*/
+static __always_inline long rate_limit_drop(struct __sk_buff *skb, cgroup_id_t cgid, struct pkt_hdrs *hdrs, __u64 len, __u64 nr_segs, __u8 reason, time_ns_t lateness_ns){
+	if(!FEATURE(STATS)){
+		return TC_ACT_SHOT;
+	}
+	struct rate_limit_stats *stats = stats_get(cgid);
+	if(!stats){
+		return TC_ACT_SHOT;
+	}
+	if(reason == RATE_LIMIT_DROP_INGRESS){
+		stats->ingress_dropped_bytes += len;
+		stats->ingress_dropped_packets += nr_segs;
+	}else{
+		stats->dropped_bytes += len;
+		stats->dropped_packets += nr_segs;
+	}
+
+	if(!rate_limit_drop_events){
+		return TC_ACT_SHOT;
+	}
+	const time_ns_t now = bpf_ktime_get_ns();
+	if(now < stats->next_event_ts){
+		stats->suppressed_drops++;
+		return TC_ACT_SHOT;
+	}
+	struct rate_limit_drop_event *event = bpf_ringbuf_reserve(&rate_limit_events, sizeof(*event), 0);
+	if(!event){
+		stats->suppressed_drops++;
+		return TC_ACT_SHOT;
+	}
+	if(hdrs->l4_proto == 0){
+		parse_hdrs(skb, hdrs);
+	}
+	event->cgroup_id = cgid;
+	event->lateness_ns = lateness_ns;
+	event->nr_suppressed = stats->suppressed_drops;
+	event->len = len;
+	event->protocol = bpf_ntohs(skb->protocol);
+	event->l4_proto = hdrs->l4_proto;
+	event->reason = reason;
+	bpf_ringbuf_submit(event, 0);
+	stats->suppressed_drops = 0;
+	stats->next_event_ts = now + RATE_LIMIT_EVENT_INTERVAL_NS;
+	return TC_ACT_SHOT;
+}
+
+/*
+	Pace skb according to the config and pacing state of its cgroup.
+	The quota is only charged for a packet which passes, *quota_len is
+	set to the bytes charged to it.
+*/
+static __always_inline long rate_limit_apply(struct __sk_buff *skb, cgroup_id_t cgid, const struct rate_limit_cfg *cfg, struct rate_limit_priv volatile *priv, __u64 *quota_len){
+	const struct rate_limit * const rlcf = &cfg->limit;
+	// A GSO packet leaves the host as gso_segs segments
+	const unsigned long long nr_segs = skb->gso_segs > 1 ? skb->gso_segs : 1;
+	unsigned long long this_pkt_len = skb->len;
+
+	struct pkt_hdrs hdrs = {0};
+	if(rlcf->byte_rate == 0 || rlcf->packet_rate == 0){
+		return rate_limit_drop(skb, cgid, &hdrs, this_pkt_len, nr_segs, RATE_LIMIT_DROP_BLOCKED, 0);
+	}
+	const int byte_limited = FEATURE(BYTE_RATE) && rlcf->byte_rate != RATE_UNLIMITED;
+	const int quota_limited = FEATURE(QUOTA) && rlcf->quota_bytes != 0;
+	const int ctrl_limited = FEATURE(CTRL) && rlcf->ctrl_packet_rate != 0;
+	if((nr_segs > 1 && (byte_limited || quota_limited)) || ctrl_limited){
+		parse_hdrs(skb, &hdrs);
+	}
+	if(nr_segs > 1){
+		/*
+			The network and transport headers are replicated into every
+			segment, the link-layer header is only counted once.
+		*/
+		this_pkt_len += (nr_segs - 1) * (hdrs.l3_len + hdrs.l4_len);
+	}
+	if(FEATURE(OVERHEAD)){
+		this_pkt_len = wire_len(skb, this_pkt_len, nr_segs);
+	}
+
+	const struct rate_limit_recip *ns_per_byte = &cfg->params.ns_per_byte;
+	__u64 *sent_bytes = NULL;
+	int past_quota = 0;
+	if(quota_limited){
+		// Only missing while the daemon is setting the limit
+		sent_bytes = bpf_map_lookup_elem(&rate_limit_quota_map, &cgid);
+		if(sent_bytes && *sent_bytes >= rlcf->quota_bytes){
+			if(rlcf->post_quota_byte_rate == 0){
+				return rate_limit_drop(skb, cgid, &hdrs, this_pkt_len, nr_segs, RATE_LIMIT_DROP_QUOTA, 0);
+			}
+			ns_per_byte = &cfg->params.ns_per_post_quota_byte;
+			past_quota = 1;
+		}
+	}
 
-	struct rate_limit_priv volatile *priv = bpf_map_lookup_elem(&rate_limit_priv_map, &cgid);
 	const unsigned long long now = bpf_ktime_get_ns();
-	if(priv){
-		const time_ns_t next_avail_ts = priv->next_avail_ts;
-		if(next_avail_ts < now){
-			//racy, not an issue, same value expected
-			priv->next_avail_ts = now + delay_ns;
-			skb->tstamp = now;
+	// Control packets bypass the budget, but count against the quota
+	if(ctrl_limited && nr_segs == 1 && is_tcp_control(&hdrs)){
+		if(rate_limit_ctrl(skb, cfg, priv, now) == TC_ACT_SHOT){
+			return rate_limit_drop(skb, cgid, &hdrs, this_pkt_len, nr_segs, RATE_LIMIT_DROP_HORIZON, 0);
+		}
+		if(sent_bytes){
+			__sync_fetch_and_add(sent_bytes, this_pkt_len);
+			*quota_len = this_pkt_len;
+		}
+		return rate_limit_pass(cgid, this_pkt_len, nr_segs, skb->tstamp > now ? skb->tstamp - now : 0, 0);
+	}
+	// The daemon refuses byte rates when BYTE_RATE is disabled, but not post-quota rates
+	const time_ns_t delay_ns_byte = FEATURE(BYTE_RATE) || FEATURE(QUOTA) ? recip_delay_ns(this_pkt_len, ns_per_byte) : 0;
+	const time_ns_t delay_ns_pkt  = FEATURE(PACKET_RATE) ? recip_delay_ns(nr_segs, &cfg->params.ns_per_pkt) : 0;
+	time_ns_t delay_ns = delay_ns_pkt > delay_ns_byte ? delay_ns_pkt : delay_ns_byte;
+	struct rate_limit_pool *pool = NULL;
+	// The post-quota rate is a ceiling of its own, nothing is borrowed beyond it
+	if(FEATURE(BORROW) && rlcf->pool_id != 0 && !past_quota){
+		delay_ns = borrow_delay(cfg, this_pkt_len, delay_ns, delay_ns_pkt, now, &pool);
+	}
+	const time_ns_t burst_ns = FEATURE(BURST) ? cfg->params.burst_ns : 0;
+
+	/*
+		Keep the departure time the socket chose for its own pacing
+		(sk_pacing_rate, BBR) if it is later, and charge the bucket from
+		there. Anything beyond the horizon cannot be an EDT timestamp
+		on the monotonic clock and is ignored.
+	*/
+	const time_ns_t horizon_ts = now + horizon_ns(cfg);
+	const time_ns_t sk_tstamp = skb->tstamp;
+	const time_ns_t depart_ts = sk_tstamp > now && sk_tstamp <= horizon_ts ? sk_tstamp : now;
+	// The reservation may lag behind the departure time by at most the burst window
+	const time_ns_t earliest_ts = depart_ts > burst_ns ? depart_ts - burst_ns : 0;
+
+	time_ns_t start_ts = horizon_ts;
+	int rc = 1;
+	if(FEATURE(FLOW_FAIR) && (rlcf->flags & RATE_LIMIT_F_FLOW_FAIR)){
+		rc = reserve_flow(skb, priv, now, earliest_ts, delay_ns, horizon_ts, &start_ts);
+	}else if(FEATURE(PERCPU) && (rlcf->flags & RATE_LIMIT_F_PERCPU)){
+		rc = reserve_percpu(cgid, earliest_ts, delay_ns, horizon_ts, &start_ts);
+	}
+	if(rc > 0){
+		rc = reserve_ts(&priv->next_avail_ts, earliest_ts, delay_ns, horizon_ts, &start_ts);
+	}
+	if(rc < 0){
+		return rate_limit_drop(skb, cgid, &hdrs, this_pkt_len, nr_segs, RATE_LIMIT_DROP_HORIZON, start_ts - horizon_ts);
+	}
+	if(sent_bytes){
+		__sync_fetch_and_add(sent_bytes, this_pkt_len);
+		*quota_len = this_pkt_len;
+	}
+	if(pool){
+		pool_charge(pool, this_pkt_len, now, horizon_ts);
+	}
+	if(rate_limit_police){
+		// Fits in the accumulated credit
+		return rate_limit_pass(cgid, this_pkt_len, nr_segs, 0, 0);
+	}
+	// Within the accumulated credit, send without further delay
+	skb->tstamp = start_ts > depart_ts ? start_ts : depart_ts;
+	// Signal congestion to ECN capable flows well before they hit the horizon
+	int marked = 0;
+	if(FEATURE(ECN) && skb->tstamp - now > cfg->params.ecn_threshold_ns){
+		marked = bpf_skb_ecn_set_ce(skb) == 1;
+	}
+	return rate_limit_pass(cgid, this_pkt_len, nr_segs, skb->tstamp > now ? skb->tstamp - now : 0, marked);
+}
+
+/*
+	Police skb received by a socket of cgroup cgid. Nothing can be
+	delayed on receive, so the bucket is a token bucket of
+	ingress_burst_ns: packets arriving while it is empty are dropped
+	and the congestion control of the sender backs off.
+*/
+static __always_inline long rate_limit_ingress_apply(struct __sk_buff *skb, cgroup_id_t cgid, const struct rate_limit_cfg *cfg, struct rate_limit_priv volatile *priv){
+	const __u64 ingress_byte_rate = cfg->limit.ingress_byte_rate;
+	// RATE_LIMIT_F_RX_WINDOW enforces the rate through the receive windows instead
+	if(ingress_byte_rate == 0 || ingress_byte_rate == RATE_UNLIMITED || (cfg->limit.flags & RATE_LIMIT_F_RX_WINDOW)){
+		return TC_ACT_OK;
+	}
+	// Segments merged by GRO arrived one by one
+	const unsigned long long nr_segs = skb->gso_segs > 1 ? skb->gso_segs : 1;
+	unsigned long long this_pkt_len = skb->len;
+	struct pkt_hdrs hdrs = {0};
+	if(nr_segs > 1){
+		parse_hdrs(skb, &hdrs);
+		this_pkt_len += (nr_segs - 1) * (hdrs.l3_len + hdrs.l4_len);
+	}
+	if(FEATURE(OVERHEAD)){
+		this_pkt_len = wire_len(skb, this_pkt_len, nr_segs);
+	}
+
+	const time_ns_t now = bpf_ktime_get_ns();
+	const time_ns_t burst_ns = cfg->params.ingress_burst_ns;
+	const time_ns_t earliest_ts = now > burst_ns ? now - burst_ns : 0;
+	const time_ns_t delay_ns = recip_delay_ns(this_pkt_len, &cfg->params.ns_per_ingress_byte);
+	time_ns_t start_ts;
+	if(reserve_ts(&priv->ingress_next_avail_ts, earliest_ts, delay_ns, now, &start_ts) < 0){
+		return rate_limit_drop(skb, cgid, &hdrs, this_pkt_len, nr_segs, RATE_LIMIT_DROP_INGRESS, start_ts - now);
+	}
+	if(FEATURE(STATS)){
+		struct rate_limit_stats *stats = stats_get(cgid);
+		if(stats){
+			stats->ingress_passed_bytes += this_pkt_len;
+			stats->ingress_passed_packets += nr_segs;
+		}
+	}
+	return TC_ACT_OK;
+}
+
+static __always_inline long rate_limit_dir_apply(struct __sk_buff *skb, cgroup_id_t cgid, const struct rate_limit_cfg *cfg, struct rate_limit_priv volatile *priv, int ingress, __u64 *quota_len){
+	return ingress ? rate_limit_ingress_apply(skb, cgid, cfg, priv) : rate_limit_apply(skb, cgid, cfg, priv, quota_len);
+}
+
+/*
+	Apply the limit of cgroup cgid, if any. Kept out of line as it is
+	called once for each limited level.
+*/
+static __noinline long rate_limit_hash(struct __sk_buff *skb, cgroup_id_t cgid, int ingress, __u64 *quota_len){
+	const __u32 slot = 0;
+	void *cfg_map = bpf_map_lookup_elem(&rate_limit_map, &slot);
+	if(!cfg_map){
+		return TC_ACT_OK;
+	}
+	const struct rate_limit_cfg * const cfg = bpf_map_lookup_elem(cfg_map, &cgid);
+	if (!cfg){
+		return TC_ACT_OK;
+	}
+	struct rate_limit_priv volatile *priv = bpf_map_lookup_elem(&rate_limit_priv_map, &cgid);
+	if(!priv){
+		// A zero timestamp starts the cgroup with full burst credit
+		const struct rate_limit_priv new_priv = {.next_avail_ts = 0};
+		bpf_map_update_elem(&rate_limit_priv_map, &cgid, &new_priv, BPF_NOEXIST);
+		priv = bpf_map_lookup_elem(&rate_limit_priv_map, &cgid);
+		if(!priv){
 			return TC_ACT_OK;
-		}else if(next_avail_ts > now + DROP_HORIZON){
-			return TC_ACT_SHOT;
-		}else{
-			skb->tstamp = next_avail_ts;
-			__sync_fetch_and_add(&priv->next_avail_ts, delay_ns);
 		}
+	}
+	return rate_limit_dir_apply(skb, cgid, cfg, priv, ingress, quota_len);
+}
+
+/*
+	Like rate_limit_hash(), with config and state kept together in
+	cgroup local storage, which is created by the daemon and freed with
+	the cgroup.
+*/
+static __noinline long rate_limit_cgrp(struct __sk_buff *skb, cgroup_id_t cgid, int ingress, __u64 *quota_len){
+	struct cgroup *cgrp = bpf_cgroup_from_id(cgid);
+	if(!cgrp){
+		return TC_ACT_OK;
+	}
+	struct rate_limit_storage *storage = bpf_cgrp_storage_get(&rate_limit_cgrp_storage, cgrp, 0, 0);
+	bpf_cgroup_release(cgrp);
+	if(!storage){
+		return TC_ACT_OK;
+	}
+	const __u32 active = *(volatile __u32 *)&storage->cfg_active;
+	// Created, but the config not written yet
+	if(active == 0){
+		return TC_ACT_OK;
+	}
+	return rate_limit_dir_apply(skb, cgid, &storage->cfg[active == 2], &storage->priv, ingress, quota_len);
+}
+
+static __always_inline long rate_limit_one(struct __sk_buff *skb, cgroup_id_t cgid, int cgrp_storage, int ingress, __u64 *quota_len){
+	return cgrp_storage ? rate_limit_cgrp(skb, cgid, ingress, quota_len) : rate_limit_hash(skb, cgid, ingress, quota_len);
+}
+
+static __always_inline void quota_refund(cgroup_id_t cgid, __u64 len){
+	__u64 *sent_bytes = bpf_map_lookup_elem(&rate_limit_quota_map, &cgid);
+	if(sent_bytes){
+		__sync_fetch_and_add(sent_bytes, -len);
+	}
+}
+
+/*
+	Enforce the limit of the cgroup of skb and of every limited
+	ancestor. Each bucket charges the packet from the departure time
+	chosen by the previous one, so the packet leaves at the latest of
+	them. A packet dropped by an ancestor stays charged to the buckets
+	below it, but not to their quotas, which only count bytes sent.
+*/
+static __always_inline long rate_limit_hier(struct __sk_buff *skb, int cgrp_storage){
+	const cgroup_id_t cgid = bpf_skb_cgroup_id(skb);
+	const __u32 level_mask = rate_limit_level_mask;
+	// Every quota is charged the same length for a packet
+	__u64 quota_len = 0;
+
+	long verdict = rate_limit_one(skb, cgid, cgrp_storage, 0, &quota_len);
+	if(verdict != TC_ACT_OK || LIKELY(level_mask == 0)){
+		return verdict;
+	}
+	const int own_charged = quota_len != 0;
+	__u32 charged_levels = 0;
+	time_ns_t latest_ts = skb->tstamp;
+	for(int level = 0; level < RATE_LIMIT_MAX_LEVELS; level++){
+		if(!(level_mask & (1u << level))){
+			continue;
+		}
+		const cgroup_id_t ancestor = bpf_skb_ancestor_cgroup_id(skb, level);
+		// Past the level of the cgroup of skb itself
+		if(ancestor == 0 || ancestor == cgid){
+			break;
+		}
+		__u64 len = 0;
+		verdict = rate_limit_one(skb, ancestor, cgrp_storage, 0, &len);
+		if(verdict != TC_ACT_OK){
+			if(own_charged){
+				quota_refund(cgid, quota_len);
+			}
+			for(int i = 0; i < level && charged_levels != 0; i++){
+				if(charged_levels & (1u << i)){
+					quota_refund(bpf_skb_ancestor_cgroup_id(skb, i), quota_len);
+				}
+			}
+			return verdict;
+		}
+		if(len != 0){
+			quota_len = len;
+			charged_levels |= 1u << level;
+		}
+		if(skb->tstamp > latest_ts){
+			latest_ts = skb->tstamp;
+		}
+	}
+	skb->tstamp = latest_ts;
+	return TC_ACT_OK;
+}
+
+/*
+	The socket in the network namespace of the interface which will
+	receive skb, or NULL. Only TCP and UDP can be looked up, and not
+	the fragments after the first one.
+*/
+static __always_inline struct bpf_sock *ingress_sk_lookup(struct __sk_buff *skb){
+	struct bpf_sock_tuple tuple = {0};
+	__u32 tuple_len;
+	__u32 l4_off;
+	__u8 l4_proto;
+	if(skb->protocol == bpf_htons(ETH_P_IP)){
+		struct iphdr iph;
+		if(bpf_skb_load_bytes_relative(skb, 0, &iph, sizeof(iph), BPF_HDR_START_NET) < 0){
+			return NULL;
+		}
+		if(iph.frag_off & bpf_htons(IP_OFFSET)){
+			return NULL;
+		}
+		tuple.ipv4.saddr = iph.saddr;
+		tuple.ipv4.daddr = iph.daddr;
+		tuple_len = sizeof(tuple.ipv4);
+		l4_off = iph.ihl * 4;
+		l4_proto = iph.protocol;
+	}else if(skb->protocol == bpf_htons(ETH_P_IPV6)){
+		struct ipv6hdr ip6h;
+		if(bpf_skb_load_bytes_relative(skb, 0, &ip6h, sizeof(ip6h), BPF_HDR_START_NET) < 0){
+			return NULL;
+		}
+		memcpy(tuple.ipv6.saddr, &ip6h.saddr, sizeof(tuple.ipv6.saddr));
+		memcpy(tuple.ipv6.daddr, &ip6h.daddr, sizeof(tuple.ipv6.daddr));
+		tuple_len = sizeof(tuple.ipv6);
+		l4_off = sizeof(ip6h);
+		l4_proto = ip6h.nexthdr;
 	}else{
-		struct rate_limit_priv new_priv = {.next_avail_ts = now + delay_ns};
-		bpf_map_update_elem(&rate_limit_priv_map, &cgid, &new_priv, BPF_ANY);
-		skb->tstamp = now;
+		return NULL;
+	}
+	if(l4_proto != IPPROTO_TCP && l4_proto != IPPROTO_UDP){
+		return NULL;
+	}
+	// Source and destination port lead both headers
+	__be16 ports[2];
+	if(bpf_skb_load_bytes_relative(skb, l4_off, ports, sizeof(ports), BPF_HDR_START_NET) < 0){
+		return NULL;
+	}
+	if(skb->protocol == bpf_htons(ETH_P_IP)){
+		tuple.ipv4.sport = ports[0];
+		tuple.ipv4.dport = ports[1];
+	}else{
+		tuple.ipv6.sport = ports[0];
+		tuple.ipv6.dport = ports[1];
+	}
+	if(l4_proto == IPPROTO_TCP){
+		return bpf_sk_lookup_tcp(skb, &tuple, tuple_len, BPF_F_CURRENT_NETNS, 0);
+	}
+	return bpf_sk_lookup_udp(skb, &tuple, tuple_len, BPF_F_CURRENT_NETNS, 0);
+}
+
+/*
+	Police skb against the ingress limits of the cgroup of the socket
+	receiving it and of its limited ancestors. The cgroups are gathered
+	first, so that the socket is released before any limit is applied.
+*/
+static __always_inline long rate_limit_ingress_hier(struct __sk_buff *skb, int cgrp_storage){
+	if(!FEATURE(INGRESS) || LIKELY(rate_limit_nr_ingress == 0)){
+		return TC_ACT_OK;
+	}
+	struct bpf_sock *sk = ingress_sk_lookup(skb);
+	if(!sk){
+		return TC_ACT_OK;
+	}
+	const __u32 level_mask = rate_limit_level_mask;
+	cgroup_id_t cgids[RATE_LIMIT_MAX_LEVELS + 1];
+	int nr_cgids = 0;
+	cgids[nr_cgids++] = bpf_sk_cgroup_id(sk);
+	for(int level = 0; level < RATE_LIMIT_MAX_LEVELS && level_mask != 0; level++){
+		if(!(level_mask & (1u << level))){
+			continue;
+		}
+		const cgroup_id_t ancestor = bpf_sk_ancestor_cgroup_id(sk, level);
+		if(ancestor == 0 || ancestor == cgids[0]){
+			break;
+		}
+		cgids[nr_cgids++] = ancestor;
+	}
+	bpf_sk_release(sk);
+
+	for(int i = 0; i < nr_cgids && i < RATE_LIMIT_MAX_LEVELS + 1; i++){
+		__u64 quota_len = 0;
+		const long verdict = rate_limit_one(skb, cgids[i], cgrp_storage, 1, &quota_len);
+		if(verdict != TC_ACT_OK){
+			return verdict;
+		}
 	}
 	return TC_ACT_OK;
 }
 
+SEC("tc/cgroup_rate_limit")
+long cgroup_rate_limit(struct __sk_buff *skb){
+	return rate_limit_hier(skb, 0);
+}
+
+/*
+	Variant keeping config and state together in cgroup local storage.
+*/
+SEC("tc/cgroup_rate_limit_cgrp")
+long cgroup_rate_limit_cgrp(struct __sk_buff *skb){
+	return rate_limit_hier(skb, 1);
+}
+
+/*
+	Variants for tcx links. Passed packets go on to the programs
+	attached after this one.
+*/
+SEC("tcx/egress")
+int cgroup_rate_limit_tcx(struct __sk_buff *skb){
+	return rate_limit_hier(skb, 0) == TC_ACT_SHOT ? TCX_DROP : TCX_NEXT;
+}
+
+SEC("tcx/egress")
+int cgroup_rate_limit_tcx_cgrp(struct __sk_buff *skb){
+	return rate_limit_hier(skb, 1) == TC_ACT_SHOT ? TCX_DROP : TCX_NEXT;
+}
+
+/*
+	Variants attached to the root cgroup, covering every interface.
+*/
+SEC("cgroup_skb/egress")
+int cgroup_rate_limit_skb(struct __sk_buff *skb){
+	return rate_limit_hier(skb, 0) == TC_ACT_SHOT ? CGROUP_SKB_DROP_CN : CGROUP_SKB_PASS;
+}
+
+SEC("cgroup_skb/egress")
+int cgroup_rate_limit_skb_cgrp(struct __sk_buff *skb){
+	return rate_limit_hier(skb, 1) == TC_ACT_SHOT ? CGROUP_SKB_DROP_CN : CGROUP_SKB_PASS;
+}
+
+/*
+	Ingress policing, attached to clsact ingress or to a tcx ingress
+	link next to the egress datapath.
+*/
+SEC("tc/cgroup_rate_limit_ingress")
+long cgroup_rate_limit_ingress(struct __sk_buff *skb){
+	return rate_limit_ingress_hier(skb, 0);
+}
+
+SEC("tc/cgroup_rate_limit_ingress_cgrp")
+long cgroup_rate_limit_ingress_cgrp(struct __sk_buff *skb){
+	return rate_limit_ingress_hier(skb, 1);
+}
+
+SEC("tcx/ingress")
+int cgroup_rate_limit_tcx_ingress(struct __sk_buff *skb){
+	return rate_limit_ingress_hier(skb, 0) == TC_ACT_SHOT ? TCX_DROP : TCX_NEXT;
+}
+
+SEC("tcx/ingress")
+int cgroup_rate_limit_tcx_ingress_cgrp(struct __sk_buff *skb){
+	return rate_limit_ingress_hier(skb, 1) == TC_ACT_SHOT ? TCX_DROP : TCX_NEXT;
+}
+
+/*
+	Clamp the receive window of the connection to its share of the
+	rate over one smoothed RTT, the bandwidth-delay product, so that
+	the sender cannot exceed it. Small changes are skipped, as this
+	runs on every RTT sample.
+*/
+static __always_inline void rx_window_clamp(struct bpf_sock_ops *skops, const struct rate_limit_rx_window *rxw, const __s64 *nr_conns){
+	struct bpf_sock *sk = skops->sk;
+	if(!sk){
+		return;
+	}
+	// Kept in units of 1/8 us
+	const __u64 srtt_us = skops->srtt_us >> 3;
+	if(srtt_us == 0){
+		return;
+	}
+	const __s64 nr = *nr_conns;
+	__u64 window = rxw->byte_rate * srtt_us / USEC_PER_SEC / (nr > 0 ? nr : 1);
+	if(window < RATE_LIMIT_MIN_RX_WINDOW){
+		window = RATE_LIMIT_MIN_RX_WINDOW;
+	}else if(window > RATE_LIMIT_MAX_RX_WINDOW){
+		window = RATE_LIMIT_MAX_RX_WINDOW;
+	}
+	struct rate_limit_rx_sock *rxs = bpf_sk_storage_get(&rate_limit_rx_sock_map, sk, 0, BPF_SK_STORAGE_GET_F_CREATE);
+	if(!rxs){
+		return;
+	}
+	const __u64 prev = rxs->window_clamp;
+	if(prev != 0 && window + prev / 8 >= prev && window <= prev + prev / 8){
+		return;
+	}
+	int val = window;
+	// Tried again on the next RTT sample unless both are set
+	if(bpf_setsockopt(skops, IPPROTO_TCP, TCP_WINDOW_CLAMP, &val, sizeof(val)) < 0){
+		return;
+	}
+	/*
+		The kernel doubles SO_RCVBUF for its overhead, leaving room for
+		the window. Setting it also stops autotuning from growing it.
+	*/
+	if(bpf_setsockopt(skops, SOL_SOCKET, SO_RCVBUF, &val, sizeof(val)) < 0){
+		return;
+	}
+	rxs->window_clamp = window;
+}
+
+/*
+	Attached by the daemon to each cgroup limited with
+	RATE_LIMIT_F_RX_WINDOW. The rate is shared by the established
+	connections of the cgroup, each being clamped again on its RTT
+	samples as they come and go.
+*/
+SEC("sockops")
+int cgroup_rate_limit_rx_window(struct bpf_sock_ops *skops){
+	struct rate_limit_rx_window *rxw = bpf_get_local_storage(&rate_limit_rx_cgroup, 0);
+	// Not written by the daemon yet
+	if(rxw->byte_rate == 0){
+		return 1;
+	}
+	__s64 *nr_conns = bpf_map_lookup_elem(&rate_limit_rx_conns_map, &rxw->cgroup_id);
+	if(!nr_conns){
+		return 1;
+	}
+	switch(skops->op){
+	case BPF_SOCK_OPS_ACTIVE_ESTABLISHED_CB:
+	case BPF_SOCK_OPS_PASSIVE_ESTABLISHED_CB:
+		__sync_fetch_and_add(nr_conns, 1);
+		bpf_sock_ops_cb_flags_set(skops, skops->bpf_sock_ops_cb_flags | BPF_SOCK_OPS_RTT_CB_FLAG | BPF_SOCK_OPS_STATE_CB_FLAG);
+		rx_window_clamp(skops, rxw, nr_conns);
+		break;
+	case BPF_SOCK_OPS_RTT_CB:
+		rx_window_clamp(skops, rxw, nr_conns);
+		break;
+	case BPF_SOCK_OPS_STATE_CB:
+		// Only called back for the connections counted when established
+		if(skops->args[1] == BPF_TCP_CLOSE){
+			__sync_fetch_and_add(nr_conns, -1);
+			bpf_sock_ops_cb_flags_set(skops, 0);
+		}
+		break;
+	}
+	return 1;
+}
+
+/*
+	Attached by the daemon to its own cgroup while it connects to itself
+	on rate_limit_rx_probe_port, before any limit is set: whether
+	bpf_setsockopt() takes TCP_WINDOW_CLAMP, which older kernels reject
+	from sock_ops.
+*/
+SEC("sockops")
+int cgroup_rate_limit_rx_probe(struct bpf_sock_ops *skops){
+	if(skops->op == BPF_SOCK_OPS_ACTIVE_ESTABLISHED_CB && skops->local_port == rate_limit_rx_probe_port){
+		int val = RATE_LIMIT_MAX_RX_WINDOW;
+		rate_limit_rx_probe_rc = bpf_setsockopt(skops, IPPROTO_TCP, TCP_WINDOW_CLAMP, &val, sizeof(val));
+	}
+	return 1;
+}
+
+/*
+	Not attached, run by the daemon with BPF_PROG_TEST_RUN: the level of
+	cgroup rate_limit_level_cgid as bpf_skb_ancestor_cgroup_id() counts
+	it, which the path of the cgroup does not tell inside a cgroup
+	namespace. -1 if there is no such cgroup.
+*/
+SEC("tc")
+int cgroup_rate_limit_level(struct __sk_buff *skb){
+	struct cgroup *cgrp = bpf_cgroup_from_id(rate_limit_level_cgid);
+	if(!cgrp){
+		return -1;
+	}
+	const int level = cgrp->level;
+	bpf_cgroup_release(cgrp);
+	return level;
+}
+
+/*
+	Not attached, run by the daemon with BPF_PROG_TEST_RUN: write
+	rate_limit_set_cfg as the config of cgroup rate_limit_set_cgid,
+	creating its storage with a zero pacing state, which starts it with
+	full burst credit. The config is written into the slot not in use
+	and switched to with one exchange, so that packets see either the
+	old or the new one, and the pacing state is left as it is. -1 if
+	there is no such cgroup.
+*/
+SEC("tc")
+int cgroup_rate_limit_cgrp_set(struct __sk_buff *skb){
+	struct cgroup *cgrp = bpf_cgroup_from_id(rate_limit_set_cgid);
+	if(!cgrp){
+		return -1;
+	}
+	struct rate_limit_storage *storage = bpf_cgrp_storage_get(&rate_limit_cgrp_storage, cgrp, 0, BPF_LOCAL_STORAGE_GET_F_CREATE);
+	bpf_cgroup_release(cgrp);
+	if(!storage){
+		return -1;
+	}
+	const __u32 slot = storage->cfg_active == 1 ? 1 : 0;
+	__builtin_memcpy(&storage->cfg[slot], &rate_limit_set_cfg, sizeof(rate_limit_set_cfg));
+	__sync_lock_test_and_set(&storage->cfg_active, slot + 1);
+	return 0;
+}
 
 char __license[] SEC("license") = "MIT";
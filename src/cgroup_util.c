@@ -6,6 +6,7 @@
 #include <linux/magic.h>
 #include <unistd.h>
 #include <errno.h>
+#include <string.h>
 #include <log.h>
 #include <cgroup_util.h>
 #include <assert.h>
@@ -89,6 +90,7 @@ union cg_file_handle{
 } cg_file_handle;
 
 #define CG_FILE_HANDLE_INIT { .file_handle.handle_bytes = sizeof(uint64_t) }
+#define FILEID_KERNFS 0xfe
 #define CG_FILE_HANDLE_CGROUPID(fh) (*(uint64_t*) (fh).file_handle.f_handle)
 
 int cg_path_get_cgroupid(const char *path, uint64_t *ret) {
@@ -113,3 +115,84 @@ int cg_path_get_cgroupid(const char *path, uint64_t *ret) {
     *ret = CG_FILE_HANDLE_CGROUPID(fh);
     return 0;
 }
+
+int cg_id_open(uint64_t id) {
+    union cg_file_handle fh = CG_FILE_HANDLE_INIT;
+
+    if(cgroupv2_root_fd < 0){
+        return -ENOMEDIUM;
+    }
+
+    fh.file_handle.handle_type = FILEID_KERNFS;
+    CG_FILE_HANDLE_CGROUPID(fh) = id;
+
+    int rc = open_by_handle_at(cgroupv2_root_fd, &fh.file_handle, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    if (rc < 0){
+        return -errno;
+    }
+    return rc;
+}
+
+/*
+    Level of the cgroup at path in the hierarchy, the root being
+    level 0.
+*/
+int cg_path_get_level(const char *path) {
+    int level = 0;
+
+    assert(path);
+    for(const char *p = path; *p; p++){
+        if(*p != '/' && (p == path || p[-1] == '/')){
+            level++;
+        }
+    }
+    return level;
+}
+
+/*
+    Open the root of the unified hierarchy, for attaching programs.
+*/
+int cg_root_open(void) {
+    if(cgroupv2_root_fd < 0){
+        return -ENOMEDIUM;
+    }
+
+    int rc = openat(cgroupv2_root_fd, ".", O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    if (rc < 0){
+        return -errno;
+    }
+    return rc;
+}
+
+/*
+    Open the cgroup of the calling process, as /proc/self/cgroup names
+    it relative to the root of the unified hierarchy.
+*/
+int cg_self_open(void) {
+    char line[4096];
+    int rc = -ENOENT;
+
+    if(cgroupv2_root_fd < 0){
+        return -ENOMEDIUM;
+    }
+
+    FILE *f = fopen("/proc/self/cgroup", "re");
+    if (f == NULL){
+        return -errno;
+    }
+    while(fgets(line, sizeof(line), f)){
+        if(strncmp(line, "0::", 3) != 0){
+            continue;
+        }
+        line[strcspn(line, "\n")] = '\0';
+        char path[sizeof(line) + 2];
+        snprintf(path, sizeof(path), ".%s", line + 3);
+        rc = openat(cgroupv2_root_fd, path, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+        if (rc < 0){
+            rc = -errno;
+        }
+        break;
+    }
+    fclose(f);
+    return rc;
+}
@@ -31,17 +31,39 @@ static void usage (int status){
     }else{
         printf("\
 Usage: %s [OPTION]... [--] COMMAND [ARG]...\n\
-", program_name);
+  or:  %s --status [--all]\n\
+", program_name, program_name);
         fputs("\
 \n\
   -p, --packet-rate=RATE          limit packet rate to RATE (default: no limit)\n\
   -b, --bit-rate=RATE             limit bit rate to RATE (default: no limit)\n\
+  -B, --burst=SIZE                allow SIZE bytes to be sent without pacing after idle (default: 0,\n\
+                                  or 10ms at the rate, at least 64K, if the daemon polices)\n\
+  -P, --burst-packets=COUNT       allow COUNT packets to be sent without pacing after idle (default: 0)\n\
+      --horizon=DURATION          drop packets which would be delayed by more than DURATION (default: 2s)\n\
+      --ecn-threshold=DURATION    mark ECN capable packets delayed by more than DURATION (default: off)\n\
+      --ack-bypass[=RATE]         let TCP packets without payload bypass the limit, paced at RATE packets per second (default: no limit)\n\
+      --quota=SIZE                allow at most SIZE bytes to be sent at the limited rate, packets bypassing\n\
+                                  the limit with --ack-bypass included (default: no limit)\n\
+      --post-quota-rate=RATE      limit bit rate to RATE once the quota is used up (default: block all packets)\n\
+      --ceil=RATE                 borrow idle capacity of the pool up to RATE bits per second, -b is then guaranteed\n\
+      --pool=POOL                 borrow from pool POOL configured in the daemon (default: 1)\n\
+      --flow-fair                 share the limit fairly among the flows of COMMAND\n\
+      --per-cpu                   split the budget into per-CPU slices, for very high rates\n\
+      --ingress-rate=RATE         drop received traffic beyond RATE bits per second (default: no limit)\n\
+      --ingress-burst=SIZE        allow SIZE bytes to be received at once (default: 10ms at the ingress rate, at least 64K)\n\
+      --rx-window                 enforce --ingress-rate by clamping TCP receive windows instead of dropping\n\
   -w, --wait=WAIT_TIME            wait for available resource for at most WAIT_TIME seconds (default: infinity) \n\
   -c, --control-socket=PATH       use PATH as control socket (default:"DEFAULT_CONTROL_SOCKET")\n\
+      --status                    show the limit and the usage of the task this command runs in\n\
+      --all                       with --status, show all tasks of the user\n\
 ", stdout);
         fputs("\
 \n\
 RATE can be suffixed with K, M, G, T to denote 1e3, 1e6, 1e9, 1e12 bits per second, respectively.\n\
+SIZE and COUNT accept the same suffixes.\n\
+\n\
+DURATION can be suffixed with ns, us, ms, s, default to seconds.\n\
 \n\
 WAIT_TIME can be suffixed with m, h, d to denote minutes, hours, days, respectively.\n\
 When WAIT_TIME is 0, this command will fail immediately when no resource available.\n\
@@ -49,12 +71,45 @@ When WAIT_TIME is 0, this command will fail immediately when no resource availab
     }
 }
 
+enum {
+    OPT_PER_CPU = 256,
+    OPT_HORIZON,
+    OPT_ECN_THRESHOLD,
+    OPT_ACK_BYPASS,
+    OPT_FLOW_FAIR,
+    OPT_CEIL,
+    OPT_POOL,
+    OPT_QUOTA,
+    OPT_POST_QUOTA_RATE,
+    OPT_INGRESS_RATE,
+    OPT_INGRESS_BURST,
+    OPT_RX_WINDOW,
+    OPT_STATUS,
+    OPT_ALL,
+};
+
 static struct option const long_options[] =
 {
     {"packet-rate", required_argument, NULL, 'p'},
     {"bit-rate", required_argument, NULL, 'b'},
+    {"burst", required_argument, NULL, 'B'},
+    {"burst-packets", required_argument, NULL, 'P'},
+    {"horizon", required_argument, NULL, OPT_HORIZON},
+    {"ecn-threshold", required_argument, NULL, OPT_ECN_THRESHOLD},
+    {"ack-bypass", optional_argument, NULL, OPT_ACK_BYPASS},
+    {"quota", required_argument, NULL, OPT_QUOTA},
+    {"post-quota-rate", required_argument, NULL, OPT_POST_QUOTA_RATE},
+    {"ingress-rate", required_argument, NULL, OPT_INGRESS_RATE},
+    {"ingress-burst", required_argument, NULL, OPT_INGRESS_BURST},
+    {"rx-window", no_argument, NULL, OPT_RX_WINDOW},
+    {"ceil", required_argument, NULL, OPT_CEIL},
+    {"pool", required_argument, NULL, OPT_POOL},
+    {"flow-fair", no_argument, NULL, OPT_FLOW_FAIR},
+    {"per-cpu", no_argument, NULL, OPT_PER_CPU},
     {"wait", required_argument, NULL, 'w'},
     {"control-socket", required_argument, NULL, 'c'},
+    {"status", no_argument, NULL, OPT_STATUS},
+    {"all", no_argument, NULL, OPT_ALL},
     {"fork", no_argument, NULL, 'f'},
     {"help", no_argument, NULL, 'h'},
     {NULL, 0, NULL, 0}
@@ -123,7 +178,139 @@ static enum parse_suffix_result parseTime(const char *string, int64_t *out_time)
     *out_time = raw_time * multiplier;
     return 0;
 }
+static enum parse_suffix_result parseDuration(const char *string, uint64_t *out_ns){
+    uint64_t raw_duration;
+    uint64_t multiplier = 1000000000;
+    char suffix[3];
+    int count = sscanf(string, "%lu%2s", &raw_duration, suffix);
+    if(count < 1){
+        return PARSE_SUFFIX_INVALID;
+    }
+    if(count == 2){
+        if(strcmp(suffix, "ns") == 0){
+            multiplier = 1;
+        }else if(strcmp(suffix, "us") == 0){
+            multiplier = 1000;
+        }else if(strcmp(suffix, "ms") == 0){
+            multiplier = 1000000;
+        }else if(strcmp(suffix, "s") != 0){
+            return PARSE_SUFFIX_INVALID_SUFFIX;
+        }
+    }
+    *out_ns = raw_duration * multiplier;
+    return 0;
+}
+
 
+static void print_rate(const char *name, uint64_t rate, uint64_t unit){
+    if(rate == RATE_UNLIMITED){
+        printf("%s: no limit\n", name);
+    }else{
+        printf("%s: %lu\n", name, rate * unit);
+    }
+}
+
+static void print_duration(const char *name, uint64_t ns){
+    printf("%s: %lu.%06lus\n", name, ns / 1000000000, ns / 1000 % 1000000);
+}
+
+static void print_status(const struct rate_limit_status_attr *status){
+    printf("%s:\n", status->scope_name);
+    print_rate("  bit rate", status->limit.byte_rate, 8);
+    print_rate("  packet rate", status->limit.packet_rate, 1);
+    if(status->limit.quota_bytes != 0){
+        printf("  quota: %lu of %lu bytes sent\n", status->sent_bytes, (uint64_t)status->limit.quota_bytes);
+        if(status->limit.post_quota_byte_rate == 0){
+            printf("  post-quota bit rate: blocked\n");
+        }else{
+            print_rate("  post-quota bit rate", status->limit.post_quota_byte_rate, 8);
+        }
+    }
+    printf("  passed: %llu bytes, %llu packets\n", status->stats.passed_bytes, status->stats.passed_packets);
+    printf("  delayed: %llu packets\n", status->stats.delayed_packets);
+    printf("  marked: %llu packets\n", status->stats.marked_packets);
+    printf("  dropped: %llu bytes, %llu packets\n", status->stats.dropped_bytes, status->stats.dropped_packets);
+    print_duration("  delay p50", status->delay_p50_ns);
+    print_duration("  delay p99", status->delay_p99_ns);
+    print_duration("  delay max", status->stats.max_delay_ns);
+    if(status->limit.ingress_byte_rate != 0 && status->limit.ingress_byte_rate != RATE_UNLIMITED){
+        print_rate("  ingress bit rate", status->limit.ingress_byte_rate, 8);
+        if(status->limit.flags & RATE_LIMIT_F_RX_WINDOW){
+            printf("  ingress enforced by receive windows\n");
+        }
+        printf("  ingress passed: %llu bytes, %llu packets\n", status->stats.ingress_passed_bytes, status->stats.ingress_passed_packets);
+        printf("  ingress dropped: %llu bytes, %llu packets\n", status->stats.ingress_dropped_bytes, status->stats.ingress_dropped_packets);
+    }
+}
+
+static void print_datapath(const struct rate_limit_datapath_attr *datapath){
+    uint64_t features = datapath->features;
+    printf("datapath: %s, %s, %s%s%s%s\n",
+        features & RATE_LIMIT_DATAPATH_CGROUP_EGRESS ? "root cgroup" : features & RATE_LIMIT_DATAPATH_TCX ? "tcx" : "tc filter",
+        features & RATE_LIMIT_DATAPATH_CGRP_STORAGE ? "cgroup local storage" : "hash maps",
+        features & RATE_LIMIT_DATAPATH_DROP_EVENTS ? "drop events" : "no drop events",
+        features & RATE_LIMIT_DATAPATH_POLICE ? ", policing" : "",
+        features & RATE_LIMIT_DATAPATH_INGRESS ? ", ingress policing" : "",
+        features & RATE_LIMIT_DATAPATH_RX_WINDOW ? ", receive window clamping" : ""
+    );
+}
+
+static int query_status(int control_sock_fd, uint64_t flags){
+    char send_buf[sizeof(struct rate_limit_msg) + sizeof(struct rate_limit_query_attr)];
+    struct rate_limit_msg *req_msg = (struct rate_limit_msg *)send_buf;
+    struct rate_limit_query_attr *req_attr = (struct rate_limit_query_attr *)req_msg->attr;
+    req_msg->length = sizeof(send_buf);
+    req_msg->type = RATE_LIMIT_QUERY;
+    req_attr->flags = flags;
+    ssize_t len = send(control_sock_fd, send_buf, sizeof(send_buf), 0);
+    if(len < 0){
+        perror("unable to send request");
+        return 1;
+    }
+    while(1){
+        char recv_buf[sizeof(struct rate_limit_msg) + sizeof(struct rate_limit_status_attr) + 1024];
+        len = recv(control_sock_fd, recv_buf, sizeof(recv_buf), 0);
+        if(len < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            perror("unable to receive response");
+            return 1;
+        }else if((size_t)len < sizeof(struct rate_limit_msg)){
+            fprintf(stderr, "unexcepted connection closed\n");
+            return 1;
+        }
+        struct rate_limit_msg *resp_msg = (struct rate_limit_msg *)recv_buf;
+        len = resp_msg->length < (size_t)len ? resp_msg->length : (size_t)len;
+        switch(resp_msg->type){
+            case RATE_LIMIT_FAIL:
+                fprintf(stderr, "unable to query status\n");
+                return 1;
+            case RATE_LIMIT_LOG:
+                fprintf(stderr, "%.*s\n", (int)((size_t)len - sizeof(struct rate_limit_msg)), resp_msg->attr);
+                break;
+            case RATE_LIMIT_STATUS:
+                if((size_t)len < sizeof(struct rate_limit_msg) + sizeof(struct rate_limit_status_attr)){
+                    fprintf(stderr, "invalid response received from daemon\n");
+                    return 1;
+                }
+                print_status((const struct rate_limit_status_attr *)resp_msg->attr);
+                break;
+            case RATE_LIMIT_DATAPATH:
+                if((size_t)len < sizeof(struct rate_limit_msg) + sizeof(struct rate_limit_datapath_attr)){
+                    fprintf(stderr, "invalid response received from daemon\n");
+                    return 1;
+                }
+                print_datapath((const struct rate_limit_datapath_attr *)resp_msg->attr);
+                break;
+            case RATE_LIMIT_PROCEED:
+                return 0;
+            default:
+                fprintf(stderr, "invalid response received from daemon\n");
+                return 1;
+        }
+    }
+}
 
 static volatile int timeout_triggered = 0;
 
@@ -137,24 +324,50 @@ int main(int argc, char *argv[]){
     struct {
         uint64_t packet_rate;
         uint64_t byte_rate;
+        uint64_t burst_bytes;
+        uint64_t burst_packets;
+        uint64_t drop_horizon_ns;
+        uint64_t ecn_threshold_ns;
+        uint64_t ctrl_packet_rate;
+        uint64_t ceil_byte_rate;
+        uint64_t pool_id;
+        uint64_t quota_bytes;
+        uint64_t post_quota_byte_rate;
+        uint64_t ingress_byte_rate;
+        uint64_t ingress_burst_bytes;
+        uint64_t flags;
         int64_t wait_time;
         const char *control_socket;
     } options = {
         .packet_rate = 0,
         .byte_rate = 0,
+        .burst_bytes = 0,
+        .burst_packets = 0,
+        .drop_horizon_ns = 0,
+        .ecn_threshold_ns = 0,
+        .ctrl_packet_rate = 0,
+        .ceil_byte_rate = 0,
+        .pool_id = 1,
+        .quota_bytes = 0,
+        .post_quota_byte_rate = 0,
+        .ingress_byte_rate = 0,
+        .ingress_burst_bytes = 0,
+        .flags = 0,
         .wait_time = -1,
         .control_socket = DEFAULT_CONTROL_SOCKET,
     };
 
     int opt;
     int debug_fork = 0;
+    int status_query = 0;
+    uint64_t query_flags = 0;
 
     if(argc == 1){
         usage(0);
         return 0;
     }
 
-    while ((opt = getopt_long (argc, argv, "+p:b:w:c:h", long_options, NULL)) != -1){
+    while ((opt = getopt_long (argc, argv, "+p:b:B:P:w:c:h", long_options, NULL)) != -1){
         switch(opt){
             case 'p':
                 if(parseRate(optarg, &options.packet_rate) != PARSE_SUFFIX_OK){
@@ -169,6 +382,91 @@ int main(int argc, char *argv[]){
                 }
                 options.byte_rate /= 8;
                 break;
+            case 'B':
+                if(parseRate(optarg, &options.burst_bytes) != PARSE_SUFFIX_OK){
+                    fprintf(stderr, "Invalid burst size: \"%s\"\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'P':
+                if(parseRate(optarg, &options.burst_packets) != PARSE_SUFFIX_OK){
+                    fprintf(stderr, "Invalid burst packet count: \"%s\"\n", optarg);
+                    return 1;
+                }
+                break;
+            case OPT_HORIZON:
+                if(parseDuration(optarg, &options.drop_horizon_ns) != PARSE_SUFFIX_OK || options.drop_horizon_ns == 0){
+                    fprintf(stderr, "Invalid horizon: \"%s\"\n", optarg);
+                    return 1;
+                }
+                break;
+            case OPT_ECN_THRESHOLD:
+                if(parseDuration(optarg, &options.ecn_threshold_ns) != PARSE_SUFFIX_OK){
+                    fprintf(stderr, "Invalid ECN threshold: \"%s\"\n", optarg);
+                    return 1;
+                }
+                break;
+            case OPT_ACK_BYPASS:
+                options.ctrl_packet_rate = RATE_UNLIMITED;
+                if(optarg && (parseRate(optarg, &options.ctrl_packet_rate) != PARSE_SUFFIX_OK || options.ctrl_packet_rate == 0)){
+                    fprintf(stderr, "Invalid control packet rate: \"%s\"\n", optarg);
+                    return 1;
+                }
+                break;
+            case OPT_QUOTA:
+                if(parseRate(optarg, &options.quota_bytes) != PARSE_SUFFIX_OK || options.quota_bytes == 0){
+                    fprintf(stderr, "Invalid quota: \"%s\"\n", optarg);
+                    return 1;
+                }
+                break;
+            case OPT_POST_QUOTA_RATE:
+                if(parseRate(optarg, &options.post_quota_byte_rate) != PARSE_SUFFIX_OK){
+                    fprintf(stderr, "Invalid post-quota bit rate: \"%s\"\n", optarg);
+                    return 1;
+                }
+                options.post_quota_byte_rate /= 8;
+                break;
+            case OPT_INGRESS_RATE:
+                if(parseRate(optarg, &options.ingress_byte_rate) != PARSE_SUFFIX_OK || options.ingress_byte_rate < 8){
+                    fprintf(stderr, "Invalid ingress bit rate: \"%s\"\n", optarg);
+                    return 1;
+                }
+                options.ingress_byte_rate /= 8;
+                break;
+            case OPT_INGRESS_BURST:
+                if(parseRate(optarg, &options.ingress_burst_bytes) != PARSE_SUFFIX_OK){
+                    fprintf(stderr, "Invalid ingress burst: \"%s\"\n", optarg);
+                    return 1;
+                }
+                break;
+            case OPT_STATUS:
+                status_query = 1;
+                break;
+            case OPT_ALL:
+                query_flags |= RATE_LIMIT_QUERY_ALL;
+                break;
+            case OPT_CEIL:
+                if(parseRate(optarg, &options.ceil_byte_rate) != PARSE_SUFFIX_OK){
+                    fprintf(stderr, "Invalid ceiling bit rate: \"%s\"\n", optarg);
+                    return 1;
+                }
+                options.ceil_byte_rate /= 8;
+                break;
+            case OPT_POOL:
+                if(sscanf(optarg, "%lu", &options.pool_id) != 1 || options.pool_id == 0){
+                    fprintf(stderr, "Invalid pool: \"%s\"\n", optarg);
+                    return 1;
+                }
+                break;
+            case OPT_FLOW_FAIR:
+                options.flags |= RATE_LIMIT_F_FLOW_FAIR;
+                break;
+            case OPT_PER_CPU:
+                options.flags |= RATE_LIMIT_F_PERCPU;
+                break;
+            case OPT_RX_WINDOW:
+                options.flags |= RATE_LIMIT_F_RX_WINDOW;
+                break;
             case 'w':
                 if(parseTime(optarg, &options.wait_time) != PARSE_SUFFIX_OK){
                     fprintf(stderr, "Invalid wait time: \"%s\"\n", optarg);
@@ -192,10 +490,15 @@ int main(int argc, char *argv[]){
         }
     }
 
+    if((options.flags & RATE_LIMIT_F_RX_WINDOW) && options.ingress_byte_rate == 0){
+        fprintf(stderr, "--rx-window needs --ingress-rate\n");
+        return 1;
+    }
+
     argc -= optind;
     argv += optind;
 
-    if(argc == 0){
+    if(argc == 0 && !status_query){
         fprintf(stderr, "No command specified\n");
         usage(1);
         return 1;
@@ -240,6 +543,10 @@ int main(int argc, char *argv[]){
             }
         }
     }
+    if(status_query){
+        return query_status(control_sock_fd, query_flags);
+    }
+
     char send_buf[sizeof(struct rate_limit_msg) + sizeof(struct rate_limit_req_attr)];
     struct rate_limit_msg *req_msg = (struct rate_limit_msg *)send_buf;
     struct rate_limit_req_attr *req_attr = (struct rate_limit_req_attr *)(&req_msg->attr);
@@ -247,6 +554,18 @@ int main(int argc, char *argv[]){
     req_msg->type = RATE_LIMIT_REQ;
     req_attr->limit.byte_rate = options.byte_rate == 0 ? RATE_UNLIMITED : options.byte_rate;
     req_attr->limit.packet_rate = options.packet_rate == 0 ? RATE_UNLIMITED : options.packet_rate;
+    req_attr->limit.burst_bytes = options.burst_bytes;
+    req_attr->limit.burst_packets = options.burst_packets;
+    req_attr->limit.drop_horizon_ns = options.drop_horizon_ns;
+    req_attr->limit.ecn_threshold_ns = options.ecn_threshold_ns;
+    req_attr->limit.ctrl_packet_rate = options.ctrl_packet_rate;
+    req_attr->limit.ceil_byte_rate = options.ceil_byte_rate;
+    req_attr->limit.pool_id = options.ceil_byte_rate == 0 ? 0 : options.pool_id;
+    req_attr->limit.quota_bytes = options.quota_bytes;
+    req_attr->limit.post_quota_byte_rate = options.post_quota_byte_rate;
+    req_attr->limit.ingress_byte_rate = options.ingress_byte_rate;
+    req_attr->limit.ingress_burst_bytes = options.ingress_burst_bytes;
+    req_attr->limit.flags = options.flags;
     req_attr->flags = 0;
     req_attr->flags |= options.wait_time < 0 ? RATE_LIMIT_REQ_NOWAIT : 0;
 
@@ -8,11 +8,13 @@
 #include <unistd.h>
 #include <time.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
 #include <assert.h>
 #include <protocol.h>
 #include <log.h>
 #include <cgroup_util.h>
 #include <s_task.h>
+#include <s_list.h>
 #include <se_libs.h>
 #include <tcbpf_util.h>
 #include "daemon.h"
@@ -20,6 +22,7 @@
 
 static const size_t STACK_SIZE = 256*1024;
 static const int NO_JOB_SLEEP_DELAY = 20 * 1000 * 1000;
+static const int REBALANCE_INTERVAL_USEC = 100 * 1000;
 
 static const int MAX_IO_USEC = 300 * 1000;
 static const int MAX_NR_TASKS = 1000;
@@ -38,6 +41,37 @@ static char *g_this_unit_name = NULL;
 static struct daemon g_daemon = {0};
 static int g_nr_tasks = 0;
 
+/*
+    Shared limit of a slice, set while some limited task is running
+    below it.
+*/
+struct slice_limit {
+    char *name;
+    struct rate_limit limit;
+    uint64_t cgroup_id;
+    int level;
+    int nr_tasks;
+};
+static struct slice_limit *g_slice_limits = NULL;
+static int g_nr_slice_limits = 0;
+
+struct limited_cgroup {
+    uint64_t cgroup_id;
+    int level;
+};
+
+// Registry of running limited tasks, for status queries
+struct task_entry {
+    s_list_t list_node;
+    uint64_t cgroup_id;
+    uid_t uid;
+    char scope_name[RATE_LIMIT_SCOPE_NAME_MAX];
+};
+static s_list_t g_tasks = {
+    .next = &g_tasks,
+    .prev = &g_tasks,
+};
+
 static int exit_req_handler(sd_event_source *s, const struct signalfd_siginfo *si, void *userdata){
     (void) si;
     (void) userdata;
@@ -64,6 +98,92 @@ static int sleep_timer_handler(sd_event_source *s, uint64_t usec, void *userdata
     return 0;
 }
 
+/*
+    Arm the rebalance timer if some cgroup is limited per CPU. Once none
+    is left, the timer is not armed again and the daemon does not wake up
+    for nothing.
+*/
+static int rebalance_timer_arm(sd_event_source *s){
+    int enabled = SD_EVENT_OFF;
+    int rc = sd_event_source_get_enabled(s, &enabled);
+    if(rc < 0){
+        log_error("get rebalance timer state failed: %s", strerror(-rc));
+        return rc;
+    }
+    if(enabled != SD_EVENT_OFF || cgroup_rate_limit_nr_percpu() == 0){
+        return 0;
+    }
+    rc = sd_event_source_set_time_relative(s, REBALANCE_INTERVAL_USEC);
+    if(rc < 0){
+        log_error("set rebalance timer failed: %s", strerror(-rc));
+        return rc;
+    }
+    rc = sd_event_source_set_enabled(s, SD_EVENT_ONESHOT);
+    if(rc < 0){
+        log_error("enable rebalance timer failed: %s", strerror(-rc));
+        return rc;
+    }
+    return 0;
+}
+
+static int rebalance_timer_handler(sd_event_source *s, uint64_t usec, void *userdata){
+    (void) usec;
+    (void) userdata;
+    cgroup_rate_limit_rebalance();
+    // Once run, a oneshot timer is off
+    return rebalance_timer_arm(s);
+}
+
+static const char *drop_reason_name(int reason){
+    switch(reason){
+        case RATE_LIMIT_DROP_BLOCKED:
+            return "blocked";
+        case RATE_LIMIT_DROP_QUOTA:
+            return "quota exceeded";
+        case RATE_LIMIT_DROP_HORIZON:
+            return "beyond horizon";
+        case RATE_LIMIT_DROP_INGRESS:
+            return "ingress policed";
+        default:
+            return "unknown";
+    }
+}
+
+// Name of the limited scope or slice owning the cgroup
+static const char *limited_cgroup_name(uint64_t cgroup_id){
+    for(s_list_t *node = g_tasks.next; node != &g_tasks; node = node->next){
+        const struct task_entry *task = (const struct task_entry *)node;
+        if(task->cgroup_id == cgroup_id){
+            return task->scope_name;
+        }
+    }
+    for(int i = 0; i < g_nr_slice_limits; i++){
+        if(g_slice_limits[i].nr_tasks > 0 && g_slice_limits[i].cgroup_id == cgroup_id){
+            return g_slice_limits[i].name;
+        }
+    }
+    return "(unknown)";
+}
+
+static void drop_event_handler(const struct rate_limit_drop_event *event){
+    log_info(
+        "%s: dropped %u bytes (ethertype 0x%04x, proto %u): %s, %lu ns late, %lu drops not reported",
+        limited_cgroup_name(event->cgroup_id),
+        event->len, event->protocol, event->l4_proto,
+        drop_reason_name(event->reason),
+        (uint64_t)event->lateness_ns, (uint64_t)event->nr_suppressed
+    );
+}
+
+static int drop_events_io_handler(sd_event_source *s, int fd, uint32_t revents, void *userdata){
+    (void) s;
+    (void) fd;
+    (void) revents;
+    (void) userdata;
+    cgroup_rate_limit_events_consume();
+    return 0;
+}
+
 static int install_signals(void){
     sigset_t mask;
     sigemptyset(&mask);
@@ -135,17 +255,274 @@ static void decrease_nr_tasks(void *dummy){
 }
 
 static void clear_rate_limit(void *data){
-    uint64_t cgroup_id = (uint64_t)(uintptr_t)data;
+    struct limited_cgroup *cgroup = data;
     int rc = 0;
-    rc = cgroup_rate_limit_unset(cgroup_id);
+    rc = cgroup_rate_limit_unset(cgroup->cgroup_id, cgroup->level);
     if(rc < 0){
-        log_error("cgroup_rate_limit_unset(%d) failed: %s (ignored)", cgroup_id, strerror(-rc));
+        log_error("cgroup_rate_limit_unset(%d) failed: %s (ignored)", cgroup->cgroup_id, strerror(-rc));
     }else{
-        log_trace("cgroup_rate_limit_unset(%d) succeed", cgroup_id);
+        log_trace("cgroup_rate_limit_unset(%d) succeed", cgroup->cgroup_id);
     }
+    free(cgroup);
 }
 
-static int get_Unit_cgroup_id(__async__, const char *unit, uint64_t *cgroup_id){
+/*
+    Parse SLICE_LIMITS, a comma separated list of
+    NAME=BIT_RATE[:PACKET_RATE]
+*/
+static int parse_slice_limits(const char *spec){
+    int rc = 0;
+    char *buf = strdup(spec);
+    if(buf == NULL){
+        return -errno;
+    }
+    char *saveptr = NULL;
+    for(char *item = strtok_r(buf, ",", &saveptr); item; item = strtok_r(NULL, ",", &saveptr)){
+        char *rates = strchr(item, '=');
+        uint64_t bit_rate, packet_rate = RATE_UNLIMITED;
+        if(rates == NULL || rates == item || sscanf(rates + 1, "%lu:%lu", &bit_rate, &packet_rate) < 1){
+            log_error("invalid slice limit: %s", item);
+            rc = -EINVAL;
+            goto out_free_buf;
+        }
+        *rates = '\0';
+        struct slice_limit *new_limits = realloc(g_slice_limits, (g_nr_slice_limits + 1) * sizeof(struct slice_limit));
+        if(new_limits == NULL){
+            rc = -errno;
+            goto out_free_buf;
+        }
+        g_slice_limits = new_limits;
+        g_slice_limits[g_nr_slice_limits] = (struct slice_limit){
+            .name = strdup(item),
+            .limit = {
+                .byte_rate = bit_rate == 0 ? RATE_UNLIMITED : bit_rate / 8,
+                .packet_rate = packet_rate == 0 ? RATE_UNLIMITED : packet_rate,
+            },
+        };
+        if(g_slice_limits[g_nr_slice_limits].name == NULL){
+            rc = -errno;
+            goto out_free_buf;
+        }
+        log_info("limit slice %s to bps=%ld, pps=%ld", item, g_slice_limits[g_nr_slice_limits].limit.byte_rate, g_slice_limits[g_nr_slice_limits].limit.packet_rate);
+        g_nr_slice_limits++;
+    }
+out_free_buf:
+    free(buf);
+    return rc;
+}
+
+/*
+    Parse a comma separated list of datapath features to compile out,
+    given by DISABLED_FEATURES.
+*/
+static int parse_disabled_features(const char *spec, uint32_t *disabled){
+    static const struct {
+        const char *name;
+        uint32_t feature;
+    } features[] = {
+        {"byte-rate", RATE_LIMIT_FEAT_BYTE_RATE},
+        {"packet-rate", RATE_LIMIT_FEAT_PACKET_RATE},
+        {"burst", RATE_LIMIT_FEAT_BURST},
+        {"stats", RATE_LIMIT_FEAT_STATS},
+        {"ecn", RATE_LIMIT_FEAT_ECN},
+        {"ack-bypass", RATE_LIMIT_FEAT_CTRL},
+        {"quota", RATE_LIMIT_FEAT_QUOTA},
+        {"borrow", RATE_LIMIT_FEAT_BORROW},
+        {"flow-fair", RATE_LIMIT_FEAT_FLOW_FAIR},
+        {"per-cpu", RATE_LIMIT_FEAT_PERCPU},
+        {"overhead", RATE_LIMIT_FEAT_OVERHEAD},
+        {"ingress", RATE_LIMIT_FEAT_INGRESS},
+        {"rx-window", RATE_LIMIT_FEAT_RX_WINDOW},
+    };
+    int rc = 0;
+    char *buf = strdup(spec);
+    if(buf == NULL){
+        return -errno;
+    }
+    *disabled = 0;
+    char *saveptr = NULL;
+    for(char *item = strtok_r(buf, ",", &saveptr); item; item = strtok_r(NULL, ",", &saveptr)){
+        size_t i;
+        for(i = 0; i < sizeof(features) / sizeof(features[0]); i++){
+            if(strcmp(item, features[i].name) == 0){
+                break;
+            }
+        }
+        if(i == sizeof(features) / sizeof(features[0])){
+            log_error("unknown datapath feature: %s", item);
+            rc = -EINVAL;
+            goto out_free_buf;
+        }
+        log_info("disable %s in the datapath", item);
+        *disabled |= features[i].feature;
+    }
+out_free_buf:
+    free(buf);
+    return rc;
+}
+
+/*
+    Parse BORROW_POOLS, a comma separated list of the bit rates of
+    pool 1, 2, ...
+*/
+static int setup_borrow_pools(const char *spec){
+    int rc = 0;
+    char *buf = strdup(spec);
+    if(buf == NULL){
+        return -errno;
+    }
+    char *saveptr = NULL;
+    uint32_t pool_id = 1;
+    for(char *item = strtok_r(buf, ",", &saveptr); item; item = strtok_r(NULL, ",", &saveptr), pool_id++){
+        uint64_t bit_rate;
+        if(sscanf(item, "%lu", &bit_rate) != 1){
+            log_error("invalid pool rate: %s", item);
+            rc = -EINVAL;
+            goto out_free_buf;
+        }
+        rc = cgroup_rate_limit_pool_set(pool_id, bit_rate / 8);
+        if(rc < 0){
+            log_error("cgroup_rate_limit_pool_set(%u) failed: %s", pool_id, strerror(-rc));
+            goto out_free_buf;
+        }
+        log_info("borrowing pool %u has bps=%ld", pool_id, bit_rate / 8);
+    }
+out_free_buf:
+    free(buf);
+    return rc;
+}
+
+/*
+    Parse a comma separated list of IF:OVERHEAD[:MPU], given by
+    OVERHEAD, and set the framing of those interfaces.
+*/
+static int setup_iface_overheads(const char *spec){
+    int rc = 0;
+    char *buf = strdup(spec);
+    if(buf == NULL){
+        return -errno;
+    }
+    char *saveptr = NULL;
+    for(char *item = strtok_r(buf, ",", &saveptr); item; item = strtok_r(NULL, ",", &saveptr)){
+        char *framing = strchr(item, ':');
+        int32_t overhead;
+        uint32_t mpu = 0;
+        if(framing == NULL || framing == item || sscanf(framing + 1, "%d:%u", &overhead, &mpu) < 1){
+            log_error("invalid interface overhead: %s", item);
+            rc = -EINVAL;
+            goto out_free_buf;
+        }
+        *framing = '\0';
+        rc = cgroup_rate_limit_iface_set(item, overhead, mpu);
+        if(rc < 0){
+            log_error("cgroup_rate_limit_iface_set(%s) failed: %s", item, strerror(-rc));
+            goto out_free_buf;
+        }
+        log_info("iface %s has overhead=%d, mpu=%u", item, overhead, mpu);
+    }
+out_free_buf:
+    free(buf);
+    return rc;
+}
+
+static void free_slice_limits(void){
+    for(int i = 0; i < g_nr_slice_limits; i++){
+        free(g_slice_limits[i].name);
+    }
+    free(g_slice_limits);
+    g_slice_limits = NULL;
+    g_nr_slice_limits = 0;
+}
+
+static void slice_limit_unref(void *data){
+    struct slice_limit *slice = data;
+    if(--slice->nr_tasks > 0){
+        return;
+    }
+    struct rate_limit_stats stats;
+    int rc = cgroup_rate_limit_stats(slice->cgroup_id, &stats);
+    if(rc == 0){
+        log_info("slice %s passed %llu bytes/%llu packets, dropped %llu bytes/%llu packets",
+            slice->name, stats.passed_bytes, stats.passed_packets, stats.dropped_bytes, stats.dropped_packets);
+    }
+    rc = cgroup_rate_limit_unset(slice->cgroup_id, slice->level);
+    if(rc < 0){
+        log_error("cgroup_rate_limit_unset(%s) failed: %s (ignored)", slice->name, strerror(-rc));
+    }else{
+        log_trace("cgroup_rate_limit_unset(%s) succeed", slice->name);
+    }
+}
+
+/*
+    Set the limits of the slices above cgroup_path, holding a reference
+    for the current task. The slices which were not limited yet take
+    their limits at once.
+*/
+static int apply_slice_limits(__async__, const char *cgroup_path){
+    int rc = 0;
+    char path[strlen(cgroup_path) + 1];
+    strcpy(path, cgroup_path);
+    int depth = 0;
+    for(const char *c = path; *c; c++){
+        depth += *c == '/';
+    }
+    struct slice_limit *slices[depth + 1];
+    struct rate_limit_update updates[depth + 1];
+    int nr_slices = 0;
+    int nr_updates = 0;
+    for(char *slash = strrchr(path, '/'); slash != NULL && slash != path; slash = strrchr(path, '/')){
+        *slash = '\0';
+        const char *name = strrchr(path, '/') + 1;
+        struct slice_limit *slice = NULL;
+        for(int i = 0; i < g_nr_slice_limits; i++){
+            if(strcmp(g_slice_limits[i].name, name) == 0){
+                slice = &g_slice_limits[i];
+                break;
+            }
+        }
+        if(slice == NULL){
+            continue;
+        }
+        bool seen = false;
+        for(int i = 0; i < nr_slices; i++){
+            seen |= slices[i] == slice;
+        }
+        slices[nr_slices++] = slice;
+        if(slice->nr_tasks == 0 && !seen){
+            rc = cg_path_get_cgroupid(path, &slice->cgroup_id);
+            if(rc < 0){
+                alog_error("cg_path_get_cgroupid(%s) failed: %s", path, strerror(-rc));
+                return rc;
+            }
+            rc = cgroup_rate_limit_level(slice->cgroup_id, path);
+            if(rc < 0){
+                alog_error("cgroup_rate_limit_level(%s) failed: %s", path, strerror(-rc));
+                return rc;
+            }
+            slice->level = rc;
+            updates[nr_updates++] = (struct rate_limit_update){
+                .cg_id = slice->cgroup_id,
+                .level = slice->level,
+                .limit = slice->limit,
+            };
+        }
+    }
+    if(nr_updates > 0){
+        rc = cgroup_rate_limit_set_many(updates, nr_updates);
+        if(rc < 0){
+            alog_error("cgroup_rate_limit_set_many(%s) failed: %s", cgroup_path, strerror(-rc));
+            return rc;
+        }
+    }
+    for(int i = 0; i < nr_slices; i++){
+        slices[i]->nr_tasks++;
+        se_task_register_memory_to_free(__await__, slices[i], slice_limit_unref);
+        alog_trace("applied limit of slice %s", slices[i]->name);
+    }
+    return 0;
+}
+
+static int get_Unit_cgroup_id(__async__, const char *unit, uint64_t *cgroup_id, char **out_cgroup_path){
 
     assert(unit);
     assert(cgroup_id);
@@ -167,6 +544,10 @@ static int get_Unit_cgroup_id(__async__, const char *unit, uint64_t *cgroup_id){
     }
     alog_trace("cgroup_id=%llu", this_cgroup_id);
     *cgroup_id = this_cgroup_id;
+    if(out_cgroup_path){
+        *out_cgroup_path = cgroup_path;
+        cgroup_path = NULL;
+    }
 
     rc = 0;
 fail_free_cgroup_path:
@@ -174,6 +555,136 @@ fail_free_cgroup_path:
     return rc;
 }
 
+static int fill_status_attr(uint64_t cgroup_id, struct rate_limit_status_attr *attr){
+    int rc = 0;
+    struct rate_limit_priv priv;
+    attr->cgroup_id = cgroup_id;
+    rc = cgroup_rate_limit_query(cgroup_id, &attr->limit, &priv);
+    if(rc < 0){
+        return rc;
+    }
+    rc = cgroup_rate_limit_quota_used(cgroup_id, &attr->sent_bytes);
+    if(rc < 0){
+        return rc;
+    }
+    rc = cgroup_rate_limit_stats(cgroup_id, &attr->stats);
+    if(rc < 0){
+        return rc;
+    }
+    attr->delay_p50_ns = rate_limit_stats_delay_quantile(&attr->stats, 500);
+    attr->delay_p99_ns = rate_limit_stats_delay_quantile(&attr->stats, 990);
+    return 0;
+}
+
+static int write_rate_limit_status(__async__, struct msg_stream *stream, const struct task_entry *task){
+    char buf[sizeof(struct rate_limit_msg) + sizeof(struct rate_limit_status_attr)];
+    memset(buf, 0, sizeof(buf));
+    struct rate_limit_msg *msg = (struct rate_limit_msg *)buf;
+    struct rate_limit_status_attr *attr = (struct rate_limit_status_attr *)msg->attr;
+    msg->length = sizeof(buf);
+    msg->type = RATE_LIMIT_STATUS;
+    strncpy(attr->scope_name, task->scope_name, sizeof(attr->scope_name) - 1);
+    int rc = fill_status_attr(task->cgroup_id, attr);
+    if(rc == -ENOENT){
+        // The task exited meanwhile
+        return 0;
+    }else if(rc < 0){
+        alog_error("fill_status_attr(%s) failed: %s", task->scope_name, strerror(-rc));
+        return rc;
+    }
+    rc = msg_stream_write(__await__, stream, buf, sizeof(buf), MAX_IO_USEC);
+    if(rc < 0){
+        return rc;
+    }
+    return 0;
+}
+
+// Tell which variant of the datapath is loaded, before the status of the scopes
+static int write_rate_limit_datapath(__async__, struct msg_stream *stream){
+    char buf[sizeof(struct rate_limit_msg) + sizeof(struct rate_limit_datapath_attr)];
+    memset(buf, 0, sizeof(buf));
+    struct rate_limit_msg *msg = (struct rate_limit_msg *)buf;
+    struct rate_limit_datapath_attr *attr = (struct rate_limit_datapath_attr *)msg->attr;
+    msg->length = sizeof(buf);
+    msg->type = RATE_LIMIT_DATAPATH;
+    attr->features = cgroup_rate_limit_datapath();
+    return msg_stream_write(__await__, stream, buf, sizeof(buf), MAX_IO_USEC);
+}
+
+/*
+    Report the limit and the usage of the scope the querying process
+    runs in, or with RATE_LIMIT_QUERY_ALL of all the scopes it may see.
+*/
+static int handle_status_query(__async__, struct msg_stream *stream, const struct ucred *cred, uint64_t flags){
+    int rc = 0;
+    int nr_entries = 0;
+    /*
+        The tasks may go away while we are writing, so work on a copy
+        of the registry.
+    */
+    struct task_entry *entries = calloc(s_list_size(&g_tasks) + 1, sizeof(struct task_entry));
+    if(entries == NULL){
+        return -errno;
+    }
+    if(flags & RATE_LIMIT_QUERY_ALL){
+        for(s_list_t *node = g_tasks.next; node != &g_tasks; node = node->next){
+            const struct task_entry *task = GET_PARENT_ADDR(node, struct task_entry, list_node);
+            if(cred->uid == 0 || cred->uid == task->uid){
+                entries[nr_entries++] = *task;
+            }
+        }
+    }else{
+        char *unit = NULL;
+        rc = sb_sd_GetUnitByPID(__await__, g_daemon.sd_bus, cred->pid, &unit);
+        if(rc < 0){
+            alog_error("sb_sd_GetUnitByPID failed: %s", strerror(-rc));
+            goto out_free_entries;
+        }
+        uint64_t cgroup_id = 0;
+        rc = get_Unit_cgroup_id(__await__, unit, &cgroup_id, NULL);
+        free(unit);
+        if(rc < 0){
+            alog_error("get_Unit_cgroup_id failed: %s", strerror(-rc));
+            goto out_free_entries;
+        }
+        for(s_list_t *node = g_tasks.next; node != &g_tasks; node = node->next){
+            const struct task_entry *task = GET_PARENT_ADDR(node, struct task_entry, list_node);
+            if(task->cgroup_id == cgroup_id){
+                entries[nr_entries++] = *task;
+                break;
+            }
+        }
+        if(nr_entries == 0){
+            write_rate_limit_log(__await__, stream, "Not running in a rate limited task");
+            rc = -ENOENT;
+            goto out_free_entries;
+        }
+    }
+    rc = write_rate_limit_datapath(__await__, stream);
+    if(rc < 0){
+        goto out_free_entries;
+    }
+    for(int i = 0; i < nr_entries; i++){
+        rc = write_rate_limit_status(__await__, stream, &entries[i]);
+        if(rc < 0){
+            goto out_free_entries;
+        }
+    }
+    rc = write_rate_limit_msg(__await__, stream, RATE_LIMIT_PROCEED, 0);
+    if(rc > 0){
+        rc = 0;
+    }
+out_free_entries:
+    free(entries);
+    return rc;
+}
+
+static void unregister_task(void *data){
+    struct task_entry *task = data;
+    s_list_detach(&task->list_node);
+    free(task);
+}
+
 static void client_handler_async(__async__, void *arg){
     enum {
         INT_IO_ERR = 1,
@@ -207,6 +718,62 @@ static void client_handler_async(__async__, void *arg){
 
     char *scope_obj = NULL;
     char *scope_name = NULL;
+    #define excepted_msg_len (sizeof(struct rate_limit_msg) + sizeof(struct rate_limit_req_attr))
+    char _buf[excepted_msg_len];
+    rc = msg_stream_read(__await__, stream, _buf, excepted_msg_len, MAX_IO_USEC);
+    if(rc < 0){
+        if(rc == -EINTR){
+            goto interrupt;
+        }
+        if(rc == -ETIMEDOUT){
+            client_error = 1;
+        }
+        alog_error("msg_stream_read failed: %s", strerror(-rc));
+        goto err_close_stream;
+    }else if(rc == 0){
+        client_error = 1;
+        alog_trace("read eof");
+        rc = -ECONNRESET;
+        goto err_close_stream;
+    }else if((unsigned int)rc < sizeof(struct rate_limit_msg)){
+        client_error = 1;
+        alog_error("invalid message size: %d", rc);
+        rc = -EINVAL;
+        goto err_close_stream;
+    }
+    struct rate_limit_msg *msg = (struct rate_limit_msg *)_buf;
+    if(msg->type == RATE_LIMIT_QUERY){
+        uint64_t query_flags = 0;
+        if((unsigned int)rc >= sizeof(struct rate_limit_msg) + sizeof(struct rate_limit_query_attr)){
+            query_flags = ((struct rate_limit_query_attr *)msg->attr)->flags;
+        }
+        rc = handle_status_query(__await__, stream, cred, query_flags);
+        if(rc < 0){
+            if(rc == -EINTR){
+                goto interrupt;
+            }
+            if(rc == -ENOENT){
+                client_error = 1;
+            }
+            goto err_close_stream;
+        }
+        shutdown_msg_stream(__await__, stream);
+        return;
+    }else if(msg->type != RATE_LIMIT_REQ || (unsigned int)rc < excepted_msg_len){
+        client_error = 1;
+        alog_error("invalid message of type %d and size %d", msg->type, rc);
+        rc = -EINVAL;
+        goto err_close_stream;
+    }
+    struct rate_limit_req_attr *attr = (struct rate_limit_req_attr *)msg->attr;
+    if(msg->length < (unsigned int)excepted_msg_len){
+        client_error = 1;
+        alog_error("invalid message size in header: %d", msg->length);
+        rc = -EINVAL;
+        goto err_close_stream;
+    }
+    #undef excepted_msg_len
+
     if(g_this_unit_name == NULL){
         char *this_unit_name = NULL;
         rc = get_self_unit_name(__await__, g_daemon.sd_bus, &this_unit_name);
@@ -243,7 +810,7 @@ static void client_handler_async(__async__, void *arg){
     se_task_register_memory_to_free(__await__, orig_unit, free);
 
     uint64_t orig_cgroup_id = 0;
-    rc = get_Unit_cgroup_id(__await__, orig_unit, &orig_cgroup_id);
+    rc = get_Unit_cgroup_id(__await__, orig_unit, &orig_cgroup_id, NULL);
     if(rc < 0){
         if(rc == -EINTR){
             goto interrupt;
@@ -291,7 +858,8 @@ static void client_handler_async(__async__, void *arg){
     pidfd_event_reg_interrupt(__await__, pidfd_event, (void *)INT_PROC_END);
 
     uint64_t cgroup_id;
-    rc = get_Unit_cgroup_id(__await__, scope_obj, &cgroup_id);
+    char *cgroup_path = NULL;
+    rc = get_Unit_cgroup_id(__await__, scope_obj, &cgroup_id, &cgroup_path);
     if(rc < 0){
         if(rc == -EINTR){
             goto interrupt;
@@ -299,59 +867,66 @@ static void client_handler_async(__async__, void *arg){
         alog_error("get_Unit_cgroup_id(scope) failed: %s", strerror(-rc));
         goto err_close_stream;
     }
-    alog_trace("cgroup_id=%llu", cgroup_id);
+    se_task_register_memory_to_free(__await__, cgroup_path, free);
+    // The task may create cgroups below its scope, which the limit also covers
+    const int cgroup_level = cgroup_rate_limit_level(cgroup_id, cgroup_path);
+    if(cgroup_level < 0){
+        rc = cgroup_level;
+        alog_error("cgroup_rate_limit_level(%s) failed: %s", cgroup_path, strerror(-rc));
+        goto err_close_stream;
+    }
+    alog_trace("cgroup_id=%llu, level=%d", cgroup_id, cgroup_level);
 
-    rc = cgroup_rate_limit_set(cgroup_id, &(struct rate_limit){.byte_rate = 0, .packet_rate = 0});
+    struct limited_cgroup *limited_cgroup = malloc(sizeof(struct limited_cgroup));
+    if(limited_cgroup == NULL){
+        rc = -errno;
+        alog_error("malloc failed: %s", strerror(-rc));
+        goto err_close_stream;
+    }
+    *limited_cgroup = (struct limited_cgroup){.cgroup_id = cgroup_id, .level = cgroup_level};
+    rc = cgroup_rate_limit_set(cgroup_id, cgroup_level, &(struct rate_limit){.byte_rate = 0, .packet_rate = 0});
     if(rc < 0){
         alog_error("cgroup_rate_limit_set failed: %s", strerror(-rc));
+        free(limited_cgroup);
         goto err_close_stream;
     }
 
-    se_task_register_memory_to_free(__await__, (void *)(uintptr_t) cgroup_id, clear_rate_limit);
+    se_task_register_memory_to_free(__await__, limited_cgroup, clear_rate_limit);
 
-    #define excepted_msg_len (sizeof(struct rate_limit_msg) + sizeof(struct rate_limit_req_attr))
-    char _buf[excepted_msg_len];
-    rc = msg_stream_read(__await__, stream, _buf, excepted_msg_len, MAX_IO_USEC);
+    rc = apply_slice_limits(__await__, cgroup_path);
     if(rc < 0){
-        if(rc == -EINTR){
-            goto interrupt;
-        }
-        if(rc == -ETIMEDOUT){
-            client_error = 1;
-        }
-        alog_error("msg_stream_read failed: %s", strerror(-rc));
-        goto err_close_stream;
-    }else if(rc == 0){
-        client_error = 1;
-        alog_trace("read eof");
-        rc = -ECONNRESET;
-        goto err_close_stream;
-    }else if((unsigned int)rc < excepted_msg_len){
-        client_error = 1;
-        alog_error("invalid message size: %d", rc);
-        rc = -EINVAL;
-        goto err_close_stream;
-    }
-    struct rate_limit_msg *msg = (struct rate_limit_msg *)_buf;
-    struct rate_limit_req_attr *attr = (struct rate_limit_req_attr *)msg->attr;
-    if(msg->length < (unsigned int)excepted_msg_len){
-        client_error = 1;
-        alog_error("invalid message size in header: %d", msg->length);
-        rc = -EINVAL;
         goto err_close_stream;
     }
-    #undef excepted_msg_len
+
     //disable interrupt from stream
     msg_stream_reg_interrupt(__await__, stream, 0);
 
-    rc = cgroup_rate_limit_set(cgroup_id, &attr->limit);
+    rc = cgroup_rate_limit_set(cgroup_id, cgroup_level, &attr->limit);
     if(rc < 0){
+        if(rc == -EINVAL || rc == -EOPNOTSUPP){
+            client_error = 1;
+        }
         alog_error("cgroup_rate_limit_set failed: %s", strerror(-rc));
         goto err_close_stream;
     }
 
-    alog_info("will start task with ratelimit bps=%ld, pps=%ld", attr->limit.byte_rate, attr->limit.packet_rate);
-    write_rate_limit_log(__await__, stream, "Start task with ratelimit bps=%ld, pps=%ld", attr->limit.byte_rate, attr->limit.packet_rate);
+    struct task_entry *task = malloc(sizeof(struct task_entry));
+    if(task == NULL){
+        rc = -errno;
+        alog_error("malloc failed: %s", strerror(-rc));
+        goto err_close_stream;
+    }
+    *task = (struct task_entry){.cgroup_id = cgroup_id, .uid = cred->uid};
+    strncpy(task->scope_name, scope_name, sizeof(task->scope_name) - 1);
+    s_list_init(&task->list_node);
+    s_list_attach(&g_tasks, &task->list_node);
+    se_task_register_memory_to_free(__await__, task, unregister_task);
+
+    alog_info("will start task with ratelimit bps=%ld, pps=%ld, burst=%ld bytes/%ld packets", attr->limit.byte_rate, attr->limit.packet_rate, attr->limit.burst_bytes, attr->limit.burst_packets);
+    write_rate_limit_log(__await__, stream, "Start task with ratelimit bps=%ld, pps=%ld, burst=%ld bytes/%ld packets", attr->limit.byte_rate, attr->limit.packet_rate, attr->limit.burst_bytes, attr->limit.burst_packets);
+    if(attr->limit.ingress_byte_rate != 0 && attr->limit.ingress_byte_rate != RATE_UNLIMITED){
+        alog_info("police ingress at bps=%ld, burst=%ld bytes", attr->limit.ingress_byte_rate, attr->limit.ingress_burst_bytes);
+    }
     write_rate_limit_msg(__await__, stream, RATE_LIMIT_PROCEED, 0);
     shutdown_msg_stream(__await__, stream);
     stream = NULL;
@@ -364,6 +939,20 @@ static void client_handler_async(__async__, void *arg){
     }else{
         alog_info("task exited");
     }
+    struct rate_limit_stats stats;
+    if(cgroup_rate_limit_stats(cgroup_id, &stats) == 0){
+        alog_info("task passed %llu bytes/%llu packets (%llu delayed, %llu marked), dropped %llu bytes/%llu packets",
+            stats.passed_bytes, stats.passed_packets, stats.delayed_packets, stats.marked_packets,
+            stats.dropped_bytes, stats.dropped_packets);
+        alog_info("task delay p50=%luns, p99=%luns, max=%lluns",
+            rate_limit_stats_delay_quantile(&stats, 500), rate_limit_stats_delay_quantile(&stats, 990), stats.max_delay_ns);
+    }
+    if(attr->limit.quota_bytes != 0){
+        uint64_t sent_bytes;
+        if(cgroup_rate_limit_quota_used(cgroup_id, &sent_bytes) == 0){
+            alog_info("task sent %lu bytes of quota %lu", sent_bytes, (uint64_t)attr->limit.quota_bytes);
+        }
+    }
     alog_trace("will kill scope: %s", scope_name);
     rc = sb_bus_call_unit_method(__await__, g_daemon.sd_bus, scope_obj, "Kill", NULL, "si", "all", SIGKILL);
     return;
@@ -413,8 +1002,27 @@ int main(int argc, char *argv[]) {
         log_set_systemd(true);
     }
 
+    /*
+        Unlike the variants of the datapath, which are probed, the
+        attach mode is the choice of the administrator: tc replaces the
+        root qdiscs of IFACES, and cgroup-police drops where the others
+        delay. Only whether the kernel supports the chosen mode is probed.
+    */
+    enum datapath_attach attach_mode = DATAPATH_ATTACH_TC;
+    const char *attach_mode_name = getenv("ATTACH_MODE");
+    if(attach_mode_name && strcmp(attach_mode_name, "tc") != 0){
+        if(strcmp(attach_mode_name, "cgroup") == 0){
+            attach_mode = DATAPATH_ATTACH_CGROUP;
+        }else if(strcmp(attach_mode_name, "cgroup-police") == 0){
+            attach_mode = DATAPATH_ATTACH_CGROUP_POLICE;
+        }else{
+            log_error("ATTACH_MODE should be one of tc, cgroup and cgroup-police");
+            return -1;
+        }
+    }
+
     const char *ifnames = getenv("IFACES");
-    if(!ifnames){
+    if(!ifnames && attach_mode == DATAPATH_ATTACH_TC){
         log_error("environment variable IFACES should be set");
         return -1;
     }
@@ -437,16 +1045,69 @@ int main(int argc, char *argv[]) {
         return -1;
     }
 
-    rc = open_and_load_bpf_obj(MAX_NR_TASKS);
+    const char *slice_limits = getenv("SLICE_LIMITS");
+    if(slice_limits){
+        rc = parse_slice_limits(slice_limits);
+        if(rc < 0){
+            log_error("parse_slice_limits failed: %s", strerror(-rc));
+            return -1;
+        }
+    }
+
+    uint32_t disabled_features = 0;
+    const char *disabled_features_spec = getenv("DISABLED_FEATURES");
+    if(disabled_features_spec){
+        rc = parse_disabled_features(disabled_features_spec, &disabled_features);
+        if(rc < 0){
+            log_error("parse_disabled_features failed: %s", strerror(-rc));
+            return -1;
+        }
+    }
+
+    const char *iface_overheads = getenv("OVERHEAD");
+    if(!iface_overheads){
+        disabled_features |= RATE_LIMIT_FEAT_OVERHEAD;
+    }
+    // Received traffic is only policed on the interfaces
+    if(attach_mode != DATAPATH_ATTACH_TC){
+        disabled_features |= RATE_LIMIT_FEAT_INGRESS;
+    }
+
+    rc = open_and_load_bpf_obj(MAX_NR_TASKS + g_nr_slice_limits, attach_mode, disabled_features);
     if(rc < 0){
         log_error("open_and_load_bpf_obj failed: %s", strerror(-rc));
         return -1;
     }
 
-    rc = tc_setup_inferface(ifnames);
-    if(rc < 0){
-        log_error("tc_setup_inferface failed: %s", strerror(-rc));
-        return -1;
+    const char *borrow_pools = getenv("BORROW_POOLS");
+    if(borrow_pools){
+        rc = setup_borrow_pools(borrow_pools);
+        if(rc < 0){
+            log_error("setup_borrow_pools failed: %s", strerror(-rc));
+            return -1;
+        }
+    }
+
+    if(iface_overheads){
+        rc = setup_iface_overheads(iface_overheads);
+        if(rc < 0){
+            log_error("setup_iface_overheads failed: %s", strerror(-rc));
+            return -1;
+        }
+    }
+
+    if(attach_mode == DATAPATH_ATTACH_TC){
+        rc = tc_setup_inferface(ifnames);
+        if(rc < 0){
+            log_error("tc_setup_inferface failed: %s", strerror(-rc));
+            return -1;
+        }
+    }else{
+        rc = cgroup_attach_datapath();
+        if(rc < 0){
+            log_error("cgroup_attach_datapath failed: %s", strerror(-rc));
+            return -1;
+        }
     }
 
     rc = sd_event_default(&g_daemon.event_loop);
@@ -493,10 +1154,39 @@ int main(int argc, char *argv[]) {
         return -1;
     }
 
+    sd_event_source *rebalance_timer = NULL;
+    rc = sd_event_add_time_relative(g_daemon.event_loop, &rebalance_timer, CLOCK_MONOTONIC, REBALANCE_INTERVAL_USEC, 0, rebalance_timer_handler, NULL);
+    if(rc < 0){
+        log_error("add rebalance timer failed: %s", strerror(-rc));
+        return -1;
+    }
+    rc = sd_event_source_set_enabled(rebalance_timer, SD_EVENT_OFF);
+    if(rc < 0){
+        log_error("set rebalance timer disabled failed: %s", strerror(-rc));
+        return -1;
+    }
+
+    sd_event_source *drop_events = NULL;
+    rc = cgroup_rate_limit_events_open(drop_event_handler);
+    if(rc == -EOPNOTSUPP){
+        log_info("drop events not supported, only counting drops");
+    }else if(rc < 0){
+        return -1;
+    }else{
+        rc = sd_event_add_io(g_daemon.event_loop, &drop_events, rc, EPOLLIN, drop_events_io_handler, NULL);
+        if(rc < 0){
+            log_error("add drop event source failed: %s", strerror(-rc));
+            return -1;
+        }
+    }
+
     log_trace("main_create");
 
     while(1){
         s_task_main_loop_once();
+        // Apply the map deletions of the tasks which exited in this iteration at once
+        cgroup_rate_limit_flush();
+        rebalance_timer_arm(rebalance_timer);
         rc = sd_event_run(g_daemon.event_loop, (uint64_t) -1);
         if(rc == -ESTALE){
             break;
@@ -560,10 +1250,17 @@ int main(int argc, char *argv[]) {
     if(sleep_timer){
         sd_event_source_disable_unref(sleep_timer);
     }
+    if(rebalance_timer){
+        sd_event_source_disable_unref(rebalance_timer);
+    }
+    if(drop_events){
+        sd_event_source_disable_unref(drop_events);
+    }
     sd_event_unrefp(&g_daemon.event_loop);
     if(g_this_unit_name){
         free(g_this_unit_name);
     }
     close_bpf_obj();
+    free_slice_limits();
     return 0;
 }
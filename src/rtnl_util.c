@@ -197,7 +197,8 @@ int rtnl_talk(struct rtnl_handle *rth, struct nlmsghdr *n, struct nlmsghdr **ans
 
             int error = err->error;
             if(error < 0){
-                log_error("NETLINK error: %s", strerror(-error));
+                // Logged by the callers, to which some errors are expected
+                log_trace("NETLINK error: %s", strerror(-error));
                 rc = error;
             }else{
                 rc = 0;
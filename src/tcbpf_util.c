@@ -9,19 +9,26 @@
 #include <linux/pkt_sched.h>
 #include <linux/pkt_cls.h>
 #include <bpf/libbpf.h>
+#include <bpf/btf.h>
 #include <linux/if_ether.h>
 #include <arpa/inet.h>
 #include <linux/bpf.h>
 #include <unistd.h>
+#include <time.h>
 #include <sys/syscall.h>
 
 
 #include <log.h>
 #include <tcbpf_util.h>
+#include <protocol.h>
+#include <cgroup_util.h>
 #include <rtnl_util.h>
 #include <cgroup_rate_limit.skel.h>
 
 #define TCA_BUF_MAX	(64*1024)
+#define TC_FILTER_PRIO 49151
+// The config map may grow to this many times its capacity at startup
+#define CFG_MAP_MAX_GROWTH 16
 
 enum qidsc_kind{
     QDISC_KIND_MQ,
@@ -77,6 +84,53 @@ struct iface_attr{
 };
 
 static struct cgroup_rate_limit *cg_rl_skel = NULL;
+static struct bpf_program *datapath_prog = NULL;
+// Policing on ingress, NULL unless attached through tc
+static struct bpf_program *ingress_prog = NULL;
+static enum datapath_attach attach_mode = DATAPATH_ATTACH_TC;
+static struct bpf_link *cgroup_link = NULL;
+static bool use_tcx = false;
+static bool use_ringbuf = false;
+static uint32_t disabled_features = 0;
+// Current inner map of rate_limit_map
+static int cfg_map_fd = -1;
+static uint32_t cfg_map_capacity = 0;
+/*
+    Capacity of the maps holding the state of each cgroup, which are not
+    preallocated. The config map grows up to it.
+*/
+static uint32_t state_map_capacity = 0;
+
+// Cgroups whose maps entries are deleted at the next cgroup_rate_limit_flush()
+static uint64_t *pending_deletes = NULL;
+static uint32_t nr_pending_deletes = 0;
+static uint32_t pending_deletes_capacity = 0;
+// sock_ops links of the cgroups limited with RATE_LIMIT_F_RX_WINDOW
+struct rx_window_link {
+    uint64_t cg_id;
+    struct bpf_link *link;
+};
+static struct rx_window_link *rx_window_links = NULL;
+static uint32_t nr_rx_window_links = 0;
+// Cgroups policed on ingress
+static uint64_t *ingress_cgroups = NULL;
+static uint32_t nr_ingress_cgroups = 0;
+static uint32_t ingress_cgroups_capacity = 0;
+// Entries of rate_limit_share_map, which are only added and removed by the daemon
+static uint32_t nr_percpu_cgroups = 0;
+// Entries of rate_limit_quota_map, likewise
+static uint32_t nr_quota_cgroups = 0;
+
+static int cfg_map_swap(uint32_t capacity, const uint64_t *cg_ids, const struct rate_limit_cfg *cfgs, uint32_t nr);
+static struct bpf_link **tcx_links = NULL;
+static int nr_tcx_links = 0;
+static bool use_cgrp_storage = false;
+static int nr_cpus = 0;
+static bool pool_configured[RATE_LIMIT_MAX_POOLS] = {0};
+// Number of limited cgroups on each level of the hierarchy
+static int level_refs[RATE_LIMIT_MAX_LEVELS] = {0};
+static struct ring_buffer *drop_events = NULL;
+static drop_event_handler_t drop_event_handler = NULL;
 
 static int get_iface_props(struct rtnl_handle *rth, unsigned int ifindex, struct iface_attr *result){
 
@@ -244,15 +298,31 @@ static int tc_del_filter(struct rtnl_handle *rth, unsigned int ifindex, __u32 pa
         .t.tcm_info = TC_H_MAKE(prio<<16, 0),
     };
 
+    // Logged by the caller, which knows whether a missing filter is an error
     int rc = rtnl_talk(rth, &req.n, NULL);
     if(rc < 0){
-        log_error("Cannot del filter chain on ifindex %u: %s", ifindex, strerror(-rc));
         return rc;
     }
     rc = 0;
     return rc;
 }
 
+/*
+    Remove the filter a previous run may have left at our priority.
+    Having none to remove is the common case: -ENOENT without the
+    filter, -EINVAL without a clsact qdisc. Neither is logged.
+*/
+static void tc_del_stale_filter(struct rtnl_handle *rth, unsigned int ifindex, const char *ifname, bool ingress){
+    const char *dir = ingress ? "ingress" : "egress";
+    log_trace("tc filter del dev %s pref %d %s", ifname, TC_FILTER_PRIO, dir);
+    const int rc = tc_del_filter(rth, ifindex, TC_H_MAKE(TC_H_CLSACT, ingress ? TC_H_MIN_INGRESS : TC_H_MIN_EGRESS), TC_FILTER_PRIO);
+    if(rc == 0){
+        log_info("removed stale tc %s filter on %s", dir, ifname);
+    }else if(rc != -ENOENT && rc != -EINVAL){
+        log_warn("tc filter del dev %s pref %d %s failed: %s (ignored)", ifname, TC_FILTER_PRIO, dir, strerror(-rc));
+    }
+}
+
 static int tc_replace_bpf_filter(struct rtnl_handle *rth, unsigned int ifindex, __u32 parent, __u32 prio, __u32 handle, int bpf_fd, const char *name){
     struct {
         struct nlmsghdr	n;
@@ -288,6 +358,127 @@ static int tc_replace_bpf_filter(struct rtnl_handle *rth, unsigned int ifindex,
     return rc;
 }
 
+/*
+    Install prog as the clsact filter of the direction, replacing the
+    one left by a previous run.
+*/
+static int tc_attach_bpf_filter(struct rtnl_handle *rth, unsigned int ifindex, const char *ifname, struct bpf_program *prog, bool ingress){
+    static const int prio = TC_FILTER_PRIO;
+    static const int handle = 1;
+    const char *dir = ingress ? "ingress" : "egress";
+    const __u32 parent = TC_H_MAKE(TC_H_CLSACT, ingress ? TC_H_MIN_INGRESS : TC_H_MIN_EGRESS);
+
+    int rc = bpf_program__fd(prog);
+    if(rc < 0){
+        log_error("bpf_program__fd failed: %s", strerror(-rc));
+        return rc;
+    }
+    int bpf_fd = rc;
+
+    int nr_try = 0;
+    while(1){
+        log_trace("tc filter replace dev %s pref %d handle %d %s bpf da fd %d", ifname, prio, handle, dir, bpf_fd);
+        rc = tc_replace_bpf_filter(rth, ifindex, parent, prio, handle, bpf_fd, bpf_program__name(prog));
+        if(rc < 0){
+            log_error("tc filter replace dev %s pref %d handle %d %s bpf da fd %d failed: %s", ifname, prio, handle, dir, bpf_fd, strerror(-rc));
+            if(nr_try > 0){
+                return rc;
+            }
+            log_info("trying del first");
+            log_trace("tc filter del dev %s pref %d %s", ifname, prio, dir);
+            rc = tc_del_filter(rth, ifindex, parent, prio);
+            if(rc < 0){
+                log_error("tc filter del dev %s pref %d %s failed: %s", ifname, prio, dir, strerror(-rc));
+                return rc;
+            }
+            nr_try ++;
+        }else{
+            break;
+        }
+    }
+    return 0;
+}
+
+/*
+    Install the datapath as a clsact egress filter, and the ingress
+    policing as an ingress filter.
+*/
+static int tc_attach_filter(struct rtnl_handle *rth, unsigned int ifindex, const char *ifname){
+    int rc = 0;
+    int nr_try = 0;
+    while(1){
+        log_trace("tc qdisc replace dev %s clsact", ifname);
+        rc = tc_replace_qdisc(rth, ifindex, TC_H_CLSACT, TC_H_MAKE(TC_H_CLSACT, 0), QDISC_KIND_CLSACT);
+        if(rc < 0){
+            log_error("tc qdisc replace dev %s clsact failed: %s", ifname, strerror(-rc));
+            if(nr_try > 0){
+                return rc;
+            }
+            log_info("trying del first");
+            log_trace("tc qdisc del dev %s clsact", ifname);
+            rc = tc_del_qdisc(rth, ifindex, TC_H_CLSACT, TC_H_MAKE(TC_H_CLSACT, 0));
+            if(rc < 0){
+                log_error("tc qdisc del dev %s clsact failed: %s", ifname, strerror(-rc));
+                return rc;
+            }
+            nr_try++;
+        }else{
+            break;
+        }
+    }
+
+    rc = tc_attach_bpf_filter(rth, ifindex, ifname, datapath_prog, false);
+    if(rc < 0){
+        return rc;
+    }
+    if(ingress_prog){
+        rc = tc_attach_bpf_filter(rth, ifindex, ifname, ingress_prog, true);
+    }else{
+        // Left by a previous run with ingress policing
+        tc_del_stale_filter(rth, ifindex, ifname, true);
+    }
+    return rc;
+}
+
+static int tcx_attach_prog(struct bpf_program *prog, unsigned int ifindex, const char *ifname){
+    struct bpf_link **links = realloc(tcx_links, (nr_tcx_links + 1) * sizeof(struct bpf_link *));
+    if(links == NULL){
+        return -errno;
+    }
+    tcx_links = links;
+
+    LIBBPF_OPTS(bpf_tcx_opts, opts, .flags = BPF_F_AFTER);
+    struct bpf_link *link = bpf_program__attach_tcx(prog, ifindex, &opts);
+    if(!link){
+        int rc = -errno;
+        log_error("bpf_program__attach_tcx(%s, %s) failed: %s", bpf_program__name(prog), ifname, strerror(-rc));
+        return rc;
+    }
+    tcx_links[nr_tcx_links++] = link;
+    return 0;
+}
+
+/*
+    Attach the datapath, and the ingress policing if any, through tcx
+    links, after the programs already attached on the interface. The
+    links are owned by the daemon, so the programs are detached when
+    the daemon exits, even by crashing.
+*/
+static int tcx_attach(struct rtnl_handle *rth, unsigned int ifindex, const char *ifname){
+    // Filters installed by a previous run without tcx would limit the traffic twice
+    tc_del_stale_filter(rth, ifindex, ifname, false);
+    tc_del_stale_filter(rth, ifindex, ifname, true);
+
+    int rc = tcx_attach_prog(datapath_prog, ifindex, ifname);
+    if(rc < 0){
+        return rc;
+    }
+    if(ingress_prog){
+        rc = tcx_attach_prog(ingress_prog, ifindex, ifname);
+    }
+    return rc;
+}
+
 static int tc_setup_one_inferface(struct rtnl_handle *rth, const char *ifname){
     unsigned int ifindex = 0;
     ifindex = if_nametoindex(ifname);
@@ -355,60 +546,15 @@ static int tc_setup_one_inferface(struct rtnl_handle *rth, const char *ifname){
             }
         }
     }
-    int nr_try = 0;
-    while(1){
-        log_trace("tc qdisc replace dev %s clsact", ifname);
-        rc = tc_replace_qdisc(rth, ifindex, TC_H_CLSACT, TC_H_MAKE(TC_H_CLSACT, 0), QDISC_KIND_CLSACT);
-        if(rc < 0){
-            log_error("tc qdisc replace dev %s clsact failed: %s", ifname, strerror(-rc));
-            if(nr_try > 0){
-                return rc;
-            }
-            log_info("trying del first");
-            log_trace("tc qdisc del dev %s clsact", ifname);
-            rc = tc_del_qdisc(rth, ifindex, TC_H_CLSACT, TC_H_MAKE(TC_H_CLSACT, 0));
-            if(rc < 0){
-                log_error("tc qdisc del dev %s clsact failed: %s", ifname, strerror(-rc));
-                return rc;
-            }
-            nr_try++;
-        }else{
-            break;
-        }
-    }
-
-    static const int prio = 49151;
-    static const int handle = 1;
 
-    rc = bpf_program__fd(cg_rl_skel->progs.cgroup_rate_limit);
+    if(use_tcx){
+        rc = tcx_attach(rth, ifindex, ifname);
+    }else{
+        rc = tc_attach_filter(rth, ifindex, ifname);
+    }
     if(rc < 0){
-        log_error("bpf_program__fd failed: %s", strerror(-rc));
         return rc;
     }
-    int bpf_fd = rc;
-
-    nr_try = 0;
-    while(1){
-        log_trace("tc filter replace dev %s pref %d handle %d egress bpf da fd %d", ifname, prio, handle, bpf_fd);
-        rc = tc_replace_bpf_filter(rth, ifindex, TC_H_MAKE(TC_H_CLSACT, TC_H_MIN_EGRESS), prio, handle, bpf_fd, "cgroup_rate_limit");
-        if(rc < 0){
-            log_error("tc filter replace dev %s pref %d handle %d egress bpf da fd %d failed: %s", ifname, prio, handle, bpf_fd, strerror(-rc));
-            if(nr_try > 0){
-                return rc;
-            }
-            log_info("trying del first");
-            log_trace("tc filter del dev %s pref %d egress", ifname, prio);
-            rc = tc_del_filter(rth, ifindex, TC_H_MAKE(TC_H_CLSACT, TC_H_MIN_EGRESS), prio);
-            if(rc < 0){
-                log_error("tc filter del dev %s pref %d egress failed: %s", ifname, prio, strerror(-rc));
-                return rc;
-            }
-            nr_try ++;
-        }else{
-            break;
-        }
-    }
-
     log_info("tc setup for %s done", ifname);
     return 0;
 }
@@ -454,6 +600,38 @@ fail:
     return rc;
 }
 
+/*
+    Attach the datapath to BPF_CGROUP_INET_EGRESS of the root cgroup,
+    which covers the traffic of every interface, including those
+    created later. Needs bpf links, available since Linux 5.7.
+*/
+int cgroup_attach_datapath(void){
+    assert(cg_rl_skel);
+    assert(attach_mode != DATAPATH_ATTACH_TC);
+    assert(!cgroup_link);
+
+    int rc = cg_root_open();
+    if(rc < 0){
+        log_error("cg_root_open() failed: %s", strerror(-rc));
+        return rc;
+    }
+    int cg_fd = rc;
+    rc = 0;
+
+    cgroup_link = bpf_program__attach_cgroup(datapath_prog, cg_fd);
+    if(!cgroup_link){
+        rc = -errno;
+        log_error("bpf_program__attach_cgroup() failed: %s", strerror(-rc));
+        goto out_close;
+    }
+    log_info("%s attached to the root cgroup%s", bpf_program__name(datapath_prog),
+        attach_mode == DATAPATH_ATTACH_CGROUP_POLICE ? ", policing" : "");
+
+out_close:
+    close(cg_fd);
+    return rc;
+}
+
 static int libbpf_print(enum libbpf_print_level level, const char *fmt, va_list ap){
     int log_level = 0;
     switch (level){
@@ -488,13 +666,187 @@ static int libbpf_print(enum libbpf_print_level level, const char *fmt, va_list
     return 0;
 }
 
-int open_and_load_bpf_obj(int max_tasks){
-    int rc = 0;
+/*
+    Cgroup local storage needs BPF_MAP_TYPE_CGRP_STORAGE and the
+    bpf_cgroup_from_id() kfunc, both available since Linux 6.2.
+*/
+static bool probe_cgrp_storage(void){
+    int rc = libbpf_probe_bpf_map_type(BPF_MAP_TYPE_CGRP_STORAGE, NULL);
+    if(rc != 1){
+        log_trace("BPF_MAP_TYPE_CGRP_STORAGE not supported");
+        return false;
+    }
+    struct btf *vmlinux_btf = btf__load_vmlinux_btf();
+    if(vmlinux_btf == NULL){
+        log_trace("btf__load_vmlinux_btf() failed: %s", strerror(errno));
+        return false;
+    }
+    rc = btf__find_by_name_kind(vmlinux_btf, "bpf_cgroup_from_id", BTF_KIND_FUNC);
+    btf__free(vmlinux_btf);
+    if(rc < 0){
+        log_trace("kfunc bpf_cgroup_from_id not found");
+        return false;
+    }
+    return true;
+}
 
-    assert(cg_rl_skel == NULL);
-    assert(max_tasks > 0);
+/*
+    tcx links, which take multiple programs per interface without
+    netlink, are available since Linux 6.6.
+*/
+static bool probe_tcx(void){
+    struct btf *vmlinux_btf = btf__load_vmlinux_btf();
+    if(vmlinux_btf == NULL){
+        log_trace("btf__load_vmlinux_btf() failed: %s", strerror(errno));
+        return false;
+    }
+    int rc = btf__find_by_name_kind(vmlinux_btf, "tcx_link", BTF_KIND_STRUCT);
+    btf__free(vmlinux_btf);
+    if(rc < 0){
+        log_trace("tcx links not supported");
+        return false;
+    }
+    return true;
+}
 
-    libbpf_set_print(libbpf_print);
+static bool probe_ringbuf(void){
+    int rc = libbpf_probe_bpf_map_type(BPF_MAP_TYPE_RINGBUF, NULL);
+    if(rc != 1){
+        log_trace("BPF_MAP_TYPE_RINGBUF not supported");
+        return false;
+    }
+    return true;
+}
+
+/*
+    Helpers the cgroup_skb variants cannot do without, which the tc
+    ones have had for long.
+*/
+static int probe_cgroup_skb_helpers(void){
+    static const enum bpf_func_id helpers[] = {
+        BPF_FUNC_skb_cgroup_id,
+        BPF_FUNC_skb_ancestor_cgroup_id,
+        BPF_FUNC_skb_ecn_set_ce,
+        BPF_FUNC_get_socket_cookie,
+    };
+    for(size_t i = 0; i < sizeof(helpers) / sizeof(helpers[0]); i++){
+        int rc = libbpf_probe_bpf_helper(BPF_PROG_TYPE_CGROUP_SKB, helpers[i], NULL);
+        if(rc < 0){
+            log_error("libbpf_probe_bpf_helper(%d) failed: %s", helpers[i], strerror(-rc));
+            return rc;
+        }else if(rc == 0){
+            log_error("helper %d not available to cgroup_skb programs", helpers[i]);
+            return -EOPNOTSUPP;
+        }
+    }
+    return 0;
+}
+
+/*
+    Receive window clamping needs socket local storage, since Linux 5.2.
+    Whether sock_ops programs may set TCP_WINDOW_CLAMP is only probed
+    once loaded, by probe_rx_window_clamp().
+*/
+static bool probe_rx_window(void){
+    int rc = libbpf_probe_bpf_map_type(BPF_MAP_TYPE_SK_STORAGE, NULL);
+    if(rc != 1){
+        log_trace("BPF_MAP_TYPE_SK_STORAGE not supported");
+        return false;
+    }
+    return true;
+}
+
+/*
+    Pick the fastest variant of the datapath the running kernel
+    supports, before loading.
+*/
+static int probe_datapath(void){
+    if(attach_mode != DATAPATH_ATTACH_TC){
+        int rc = probe_cgroup_skb_helpers();
+        if(rc < 0){
+            return rc;
+        }
+        use_tcx = false;
+    }else{
+        use_tcx = probe_tcx();
+    }
+    use_cgrp_storage = probe_cgrp_storage();
+    // Drop events are rate limited with the counters
+    use_ringbuf = !(disabled_features & RATE_LIMIT_FEAT_STATS) && probe_ringbuf();
+    if(!(disabled_features & RATE_LIMIT_FEAT_RX_WINDOW) && !probe_rx_window()){
+        log_warn("receive window clamping is not supported by the kernel");
+        disabled_features |= RATE_LIMIT_FEAT_RX_WINDOW;
+    }
+    return 0;
+}
+
+/*
+    Older kernels, 5.10 among them, reject TCP_WINDOW_CLAMP from
+    bpf_setsockopt() in sock_ops programs, which only shows when it
+    runs. Run it on a loopback connection of the daemon, with the probe
+    program attached to the cgroup of the daemon meanwhile.
+*/
+static bool probe_rx_window_clamp(void){
+    struct sockaddr_in server = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    struct sockaddr_in client = server;
+    socklen_t addr_len = sizeof(server);
+    int listen_fd = -1, fd = -1;
+    bool supported = false;
+
+    int cg_fd = cg_self_open();
+    if(cg_fd < 0){
+        log_trace("cg_self_open() failed: %s", strerror(-cg_fd));
+        return false;
+    }
+    struct bpf_link *link = bpf_program__attach_cgroup(cg_rl_skel->progs.cgroup_rate_limit_rx_probe, cg_fd);
+    close(cg_fd);
+    if(!link){
+        log_trace("bpf_program__attach_cgroup(rx probe) failed: %s", strerror(errno));
+        return false;
+    }
+    listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(listen_fd < 0 || fd < 0 ||
+        bind(listen_fd, (struct sockaddr *)&server, sizeof(server)) < 0 ||
+        listen(listen_fd, 1) < 0 ||
+        getsockname(listen_fd, (struct sockaddr *)&server, &addr_len) < 0 ||
+        bind(fd, (struct sockaddr *)&client, sizeof(client)) < 0 ||
+        getsockname(fd, (struct sockaddr *)&client, &addr_len) < 0
+    ){
+        log_trace("loopback sockets failed: %s", strerror(errno));
+        goto out;
+    }
+    cg_rl_skel->bss->rate_limit_rx_probe_port = ntohs(client.sin_port);
+    cg_rl_skel->bss->rate_limit_rx_probe_rc = 1;
+    // The connection is established on loopback before connect() returns
+    if(connect(fd, (struct sockaddr *)&server, sizeof(server)) < 0){
+        log_trace("connect() failed: %s", strerror(errno));
+        goto out;
+    }
+    const int rc = cg_rl_skel->bss->rate_limit_rx_probe_rc;
+    if(rc > 0){
+        log_trace("rx probe program did not run");
+    }else if(rc < 0){
+        log_trace("bpf_setsockopt(TCP_WINDOW_CLAMP) failed: %s", strerror(-rc));
+    }
+    supported = rc == 0;
+
+out:
+    if(fd >= 0){
+        close(fd);
+    }
+    if(listen_fd >= 0){
+        close(listen_fd);
+    }
+    bpf_link__destroy(link);
+    return supported;
+}
+
+static int load_bpf_obj(int max_entries, bool cgrp_storage){
+    int rc = 0;
 
     cg_rl_skel = cgroup_rate_limit__open();
     if(cg_rl_skel == NULL){
@@ -503,12 +855,64 @@ int open_and_load_bpf_obj(int max_tasks){
         goto fail;
     }
 
-    max_tasks += (max_tasks + 7) / 8;
-
     bpf_program__set_type(cg_rl_skel->progs.cgroup_rate_limit, BPF_PROG_TYPE_SCHED_CLS);
     bpf_program__set_expected_attach_type(cg_rl_skel->progs.cgroup_rate_limit, 0);
-    bpf_map__set_max_entries(cg_rl_skel->maps.rate_limit_map, max_tasks);
-    bpf_map__set_max_entries(cg_rl_skel->maps.rate_limit_priv_map, max_tasks);
+    bpf_program__set_type(cg_rl_skel->progs.cgroup_rate_limit_cgrp, BPF_PROG_TYPE_SCHED_CLS);
+    bpf_program__set_expected_attach_type(cg_rl_skel->progs.cgroup_rate_limit_cgrp, 0);
+    const bool at_cgroup = attach_mode != DATAPATH_ATTACH_TC;
+    struct bpf_program *progs[] = {
+        cg_rl_skel->progs.cgroup_rate_limit,
+        cg_rl_skel->progs.cgroup_rate_limit_cgrp,
+        cg_rl_skel->progs.cgroup_rate_limit_tcx,
+        cg_rl_skel->progs.cgroup_rate_limit_tcx_cgrp,
+        cg_rl_skel->progs.cgroup_rate_limit_skb,
+        cg_rl_skel->progs.cgroup_rate_limit_skb_cgrp,
+    };
+    datapath_prog = progs[(at_cgroup ? 4 : use_tcx ? 2 : 0) + cgrp_storage];
+    for(size_t i = 0; i < sizeof(progs) / sizeof(progs[0]); i++){
+        bpf_program__set_autoload(progs[i], progs[i] == datapath_prog);
+    }
+    bpf_program__set_type(cg_rl_skel->progs.cgroup_rate_limit_ingress, BPF_PROG_TYPE_SCHED_CLS);
+    bpf_program__set_expected_attach_type(cg_rl_skel->progs.cgroup_rate_limit_ingress, 0);
+    bpf_program__set_type(cg_rl_skel->progs.cgroup_rate_limit_ingress_cgrp, BPF_PROG_TYPE_SCHED_CLS);
+    bpf_program__set_expected_attach_type(cg_rl_skel->progs.cgroup_rate_limit_ingress_cgrp, 0);
+    struct bpf_program *ingress_progs[] = {
+        cg_rl_skel->progs.cgroup_rate_limit_ingress,
+        cg_rl_skel->progs.cgroup_rate_limit_ingress_cgrp,
+        cg_rl_skel->progs.cgroup_rate_limit_tcx_ingress,
+        cg_rl_skel->progs.cgroup_rate_limit_tcx_ingress_cgrp,
+    };
+    ingress_prog = NULL;
+    if(!at_cgroup && !(disabled_features & RATE_LIMIT_FEAT_INGRESS)){
+        ingress_prog = ingress_progs[(use_tcx ? 2 : 0) + cgrp_storage];
+    }
+    for(size_t i = 0; i < sizeof(ingress_progs) / sizeof(ingress_progs[0]); i++){
+        bpf_program__set_autoload(ingress_progs[i], ingress_progs[i] == ingress_prog);
+    }
+    const bool rx_window = !(disabled_features & RATE_LIMIT_FEAT_RX_WINDOW);
+    bpf_program__set_autoload(cg_rl_skel->progs.cgroup_rate_limit_rx_window, rx_window);
+    bpf_program__set_autoload(cg_rl_skel->progs.cgroup_rate_limit_rx_probe, rx_window);
+    bpf_map__set_autocreate(cg_rl_skel->maps.rate_limit_rx_cgroup, rx_window);
+    bpf_map__set_autocreate(cg_rl_skel->maps.rate_limit_rx_sock_map, rx_window);
+    bpf_map__set_autocreate(cg_rl_skel->maps.rate_limit_rx_conns_map, rx_window);
+    cg_rl_skel->rodata->rate_limit_cgroup_egress = at_cgroup;
+    cg_rl_skel->rodata->rate_limit_police = attach_mode == DATAPATH_ATTACH_CGROUP_POLICE;
+    bpf_map__set_autocreate(cg_rl_skel->maps.rate_limit_cgrp_storage, cgrp_storage);
+    bpf_program__set_autoload(cg_rl_skel->progs.cgroup_rate_limit_cgrp_set, cgrp_storage);
+    // Needs bpf_cgroup_from_id(), probed together with cgroup local storage
+    bpf_program__set_autoload(cg_rl_skel->progs.cgroup_rate_limit_level, cgrp_storage);
+    bpf_map__set_autocreate(cg_rl_skel->maps.rate_limit_events, use_ringbuf);
+    cg_rl_skel->rodata->rate_limit_drop_events = use_ringbuf;
+    cg_rl_skel->rodata->rate_limit_features = RATE_LIMIT_FEAT_ALL & ~disabled_features;
+    bpf_map__set_autocreate(cg_rl_skel->maps.rate_limit_map, !cgrp_storage);
+    // Sized for the largest config map, the entries are only allocated when used
+    state_map_capacity = max_entries * CFG_MAP_MAX_GROWTH;
+    bpf_map__set_max_entries(cg_rl_skel->maps.rate_limit_priv_map, state_map_capacity);
+    bpf_map__set_max_entries(cg_rl_skel->maps.rate_limit_quota_map, state_map_capacity);
+    bpf_map__set_max_entries(cg_rl_skel->maps.rate_limit_share_map, state_map_capacity);
+    bpf_map__set_max_entries(cg_rl_skel->maps.rate_limit_shard_map, state_map_capacity);
+    bpf_map__set_max_entries(cg_rl_skel->maps.rate_limit_stats_map, state_map_capacity);
+    bpf_map__set_max_entries(cg_rl_skel->maps.rate_limit_rx_conns_map, state_map_capacity);
 
     rc = cgroup_rate_limit__load(cg_rl_skel);
     if(rc < 0){
@@ -521,15 +925,144 @@ int open_and_load_bpf_obj(int max_tasks){
 fail_free_skel:
     cgroup_rate_limit__destroy(cg_rl_skel);
     cg_rl_skel = NULL;
+    datapath_prog = NULL;
+    ingress_prog = NULL;
 fail:
     return rc;
 }
 
+int open_and_load_bpf_obj(int max_tasks, enum datapath_attach mode, uint32_t disabled){
+    int rc = 0;
+
+    assert(cg_rl_skel == NULL);
+    assert(max_tasks > 0);
+
+    attach_mode = mode;
+    disabled_features = disabled;
+
+    libbpf_set_print(libbpf_print);
+
+    rc = libbpf_num_possible_cpus();
+    if(rc < 0){
+        log_error("libbpf_num_possible_cpus() failed: %s", strerror(-rc));
+        return rc;
+    }
+    nr_cpus = rc;
+
+    max_tasks += (max_tasks + 7) / 8;
+
+    rc = probe_datapath();
+    if(rc < 0){
+        return rc;
+    }
+    rc = load_bpf_obj(max_tasks, use_cgrp_storage);
+    if(rc < 0 && use_cgrp_storage){
+        log_warn("cannot load cgroup local storage datapath, falling back to hash maps");
+        use_cgrp_storage = false;
+        rc = load_bpf_obj(max_tasks, use_cgrp_storage);
+    }
+    if(rc < 0){
+        return rc;
+    }
+    if(!use_cgrp_storage){
+        rc = cfg_map_swap(max_tasks, NULL, NULL, 0);
+        if(rc < 0){
+            close_bpf_obj();
+            return rc;
+        }
+    }
+    if(!(disabled_features & RATE_LIMIT_FEAT_RX_WINDOW) && !probe_rx_window_clamp()){
+        log_warn("receive window clamping is not supported by the kernel");
+        disabled_features |= RATE_LIMIT_FEAT_RX_WINDOW;
+    }
+    log_info("datapath: %s, %s, %s, %s, %s",
+        attach_mode != DATAPATH_ATTACH_TC ? "root cgroup" : use_tcx ? "tcx" : "tc filter",
+        use_cgrp_storage ? "cgroup local storage" : "hash maps",
+        use_ringbuf ? "drop events" : "no drop events",
+        ingress_prog ? "ingress policing" : "no ingress policing",
+        disabled_features & RATE_LIMIT_FEAT_RX_WINDOW ? "no receive window clamping" : "receive window clamping"
+    );
+    return 0;
+}
+
+// Features of the loaded datapath, as RATE_LIMIT_DATAPATH_* flags
+uint64_t cgroup_rate_limit_datapath(void){
+    assert(cg_rl_skel);
+
+    uint64_t features = 0;
+    if(attach_mode != DATAPATH_ATTACH_TC){
+        features |= RATE_LIMIT_DATAPATH_CGROUP_EGRESS;
+    }
+    if(attach_mode == DATAPATH_ATTACH_CGROUP_POLICE){
+        features |= RATE_LIMIT_DATAPATH_POLICE;
+    }
+    if(use_tcx){
+        features |= RATE_LIMIT_DATAPATH_TCX;
+    }
+    if(use_cgrp_storage){
+        features |= RATE_LIMIT_DATAPATH_CGRP_STORAGE;
+    }
+    if(use_ringbuf){
+        features |= RATE_LIMIT_DATAPATH_DROP_EVENTS;
+    }
+    if(ingress_prog){
+        features |= RATE_LIMIT_DATAPATH_INGRESS;
+    }
+    if(!(disabled_features & RATE_LIMIT_FEAT_RX_WINDOW)){
+        features |= RATE_LIMIT_DATAPATH_RX_WINDOW;
+    }
+    return features;
+}
+
 int close_bpf_obj(void){
     assert(cg_rl_skel);
 
+    if(drop_events){
+        ring_buffer__free(drop_events);
+        drop_events = NULL;
+        drop_event_handler = NULL;
+    }
+    if(cgroup_link){
+        bpf_link__destroy(cgroup_link);
+        cgroup_link = NULL;
+    }
+    for(int i = 0; i < nr_tcx_links; i++){
+        bpf_link__destroy(tcx_links[i]);
+    }
+    for(uint32_t i = 0; i < nr_rx_window_links; i++){
+        bpf_link__destroy(rx_window_links[i].link);
+    }
+    free(rx_window_links);
+    rx_window_links = NULL;
+    nr_rx_window_links = 0;
+    free(tcx_links);
+    tcx_links = NULL;
+    nr_tcx_links = 0;
+    use_tcx = false;
+    use_ringbuf = false;
     cgroup_rate_limit__destroy(cg_rl_skel);
     cg_rl_skel = NULL;
+    datapath_prog = NULL;
+    ingress_prog = NULL;
+    attach_mode = DATAPATH_ATTACH_TC;
+    disabled_features = 0;
+    free(pending_deletes);
+    pending_deletes = NULL;
+    nr_pending_deletes = 0;
+    pending_deletes_capacity = 0;
+    nr_percpu_cgroups = 0;
+    nr_quota_cgroups = 0;
+    free(ingress_cgroups);
+    ingress_cgroups = NULL;
+    nr_ingress_cgroups = 0;
+    ingress_cgroups_capacity = 0;
+    if(cfg_map_fd >= 0){
+        close(cfg_map_fd);
+        cfg_map_fd = -1;
+        cfg_map_capacity = 0;
+    }
+    memset(level_refs, 0, sizeof(level_refs));
+    memset(pool_configured, 0, sizeof(pool_configured));
     return 0;
 }
 
@@ -540,7 +1073,11 @@ static inline __u64 ptr_to_u64(const void *ptr){
     return (__u64) (uintptr_t) ptr;
 }
 
+// Map syscalls issued, for judging how well they are batched
+static uint64_t nr_bpf_syscalls = 0;
+
 static inline int sys_bpf(enum bpf_cmd cmd, union bpf_attr *attr, unsigned int size){
+    nr_bpf_syscalls++;
     return syscall(SYS_bpf, cmd, attr, size);
 }
 
@@ -573,6 +1110,20 @@ static int bpf_map_delete_elem(int fd, const void *key){
     return rc;
 }
 
+static int bpf_map_get_next_key(int fd, const void *key, void *next_key){
+    union bpf_attr attr = {
+        .map_fd = fd,
+        .key = ptr_to_u64(key),
+        .next_key = ptr_to_u64(next_key),
+    };
+    int rc;
+    rc = sys_bpf(BPF_MAP_GET_NEXT_KEY, &attr, sizeof(attr));
+    if(rc < 0){
+        rc = -errno;
+    }
+    return rc;
+}
+
 static int bpf_lookup_elem(int fd, const void *key, void *value){
     union bpf_attr attr = {
         .map_fd = fd,
@@ -587,42 +1138,1474 @@ static int bpf_lookup_elem(int fd, const void *key, void *value){
     return rc;
 }
 
-
-int cgroup_rate_limit_set(uint64_t cg_id, const struct rate_limit *limit){
-    int rc = 0;
-    rc = bpf_map_update_elem(bpf_map__fd(cg_rl_skel->maps.rate_limit_map), &cg_id, limit, BPF_ANY);
+// Run a tc program once on a packet it does not look at, for its return value
+static int bpf_prog_run(int prog_fd, int *retval){
+    // The smallest packet BPF_PROG_TEST_RUN takes for tc
+    uint8_t pkt[ETH_HLEN] = {0};
+    union bpf_attr attr = {
+        .test.prog_fd      = prog_fd,
+        .test.data_in      = ptr_to_u64(pkt),
+        .test.data_size_in = sizeof(pkt),
+    };
+    int rc;
+    rc = sys_bpf(BPF_PROG_TEST_RUN, &attr, sizeof(attr));
     if(rc < 0){
-        log_error("bpf_map_update_elem() failed: %s", strerror(-rc));
-        goto fail;
+        return -errno;
     }
-fail:
-    return rc;
+    *retval = attr.test.retval;
+    return 0;
 }
 
-int cgroup_rate_limit_unset(uint64_t cg_id){
-    int rc = 0;
-    rc = bpf_map_delete_elem(bpf_map__fd(cg_rl_skel->maps.rate_limit_map), &cg_id);
-    if(rc < 0){
+/*
+    The batch operations process up to *count elements and store the
+    number processed in *count, also on failure.
+*/
+static int bpf_map_lookup_batch(int fd, const void *in_batch, void *out_batch, void *keys, void *values, uint32_t *count){
+    union bpf_attr attr = {
+        .batch = {
+            .in_batch = ptr_to_u64(in_batch),
+            .out_batch = ptr_to_u64(out_batch),
+            .keys = ptr_to_u64(keys),
+            .values = ptr_to_u64(values),
+            .count = *count,
+            .map_fd = fd,
+        },
+    };
+    int rc;
+    rc = sys_bpf(BPF_MAP_LOOKUP_BATCH, &attr, sizeof(attr));
+    if(rc < 0){
+        rc = -errno;
+    }
+    *count = attr.batch.count;
+    return rc;
+}
+
+static int bpf_map_update_batch(int fd, const void *keys, const void *values, uint32_t *count, __u64 elem_flags){
+    union bpf_attr attr = {
+        .batch = {
+            .keys = ptr_to_u64(keys),
+            .values = ptr_to_u64(values),
+            .count = *count,
+            .map_fd = fd,
+            .elem_flags = elem_flags,
+        },
+    };
+    int rc;
+    rc = sys_bpf(BPF_MAP_UPDATE_BATCH, &attr, sizeof(attr));
+    if(rc < 0){
+        rc = -errno;
+    }
+    *count = attr.batch.count;
+    return rc;
+}
+
+static int bpf_map_delete_batch(int fd, const void *keys, uint32_t *count){
+    union bpf_attr attr = {
+        .batch = {
+            .keys = ptr_to_u64(keys),
+            .count = *count,
+            .map_fd = fd,
+        },
+    };
+    int rc;
+    rc = sys_bpf(BPF_MAP_DELETE_BATCH, &attr, sizeof(attr));
+    if(rc < 0){
+        rc = -errno;
+    }
+    *count = attr.batch.count;
+    return rc;
+}
+
+/*
+    Read up to max_entries entries of a hash map keyed by cgroup id, in
+    as few syscalls as the kernel allows. Returns the number read.
+*/
+static int map_read_all(int fd, uint32_t max_entries, uint64_t *keys, void *values, size_t value_size){
+    uint64_t in_batch = 0, out_batch = 0;
+    uint32_t nr_read = 0;
+    int rc = 0;
+    while(nr_read < max_entries){
+        uint32_t count = max_entries - nr_read;
+        rc = bpf_map_lookup_batch(fd, nr_read == 0 ? NULL : &in_batch, &out_batch, keys + nr_read, (char *)values + nr_read * value_size, &count);
+        nr_read += count;
+        if(rc == -ENOENT){
+            // No more entries
+            break;
+        }else if(rc < 0){
+            return rc;
+        }
+        in_batch = out_batch;
+    }
+    return nr_read;
+}
+
+/*
+    Read all entries of a hash map keyed by cgroup id into buffers
+    allocated for them, which start with room for hint entries and are
+    grown until everything fits. Returns the number read.
+*/
+static int map_read_alloc(int fd, uint32_t hint, size_t value_size, uint64_t **keys, void **values){
+    uint32_t capacity = hint > 16 ? hint : 16;
+    int rc = 0;
+    for(;;){
+        *keys = calloc(capacity, sizeof(uint64_t));
+        *values = calloc(capacity, value_size);
+        if(!*keys || !*values){
+            rc = -ENOMEM;
+            break;
+        }
+        rc = map_read_all(fd, capacity, *keys, *values, value_size);
+        // A full buffer may have left entries unread
+        const bool full = rc == -ENOSPC || (uint32_t)rc == capacity;
+        if(!full || capacity >= state_map_capacity){
+            break;
+        }
+        free(*values);
+        free(*keys);
+        capacity *= 2;
+    }
+    if(rc < 0){
+        free(*values);
+        free(*keys);
+        *keys = NULL;
+        *values = NULL;
+    }
+    return rc;
+}
+
+/*
+    Delete the given keys, which should all exist, in as few syscalls
+    as the kernel allows. A batch stops at the first missing key, which
+    is skipped at the cost of another syscall. Returns the number of
+    keys deleted.
+*/
+static int map_delete_all(int fd, const uint64_t *keys, uint32_t nr_keys){
+    uint32_t done = 0;
+    int nr_deleted = 0;
+    while(done < nr_keys){
+        uint32_t count = nr_keys - done;
+        int rc = bpf_map_delete_batch(fd, keys + done, &count);
+        done += count;
+        nr_deleted += count;
+        if(rc == -ENOENT){
+            done++;
+        }else if(rc < 0){
+            return rc;
+        }
+    }
+    return nr_deleted;
+}
+
+/*
+    Write the given entries in as few syscalls as the kernel allows.
+*/
+static int map_update_all(int fd, const uint64_t *keys, const void *values, size_t value_size, uint32_t nr_keys){
+    uint32_t done = 0;
+    while(done < nr_keys){
+        uint32_t count = nr_keys - done;
+        int rc = bpf_map_update_batch(fd, keys + done, (const char *)values + done * value_size, &count, BPF_ANY);
+        if(rc < 0){
+            return rc;
+        }
+        done += count;
+    }
+    return 0;
+}
+
+static int cg_id_cmp(const void *a, const void *b){
+    const uint64_t x = *(const uint64_t *)a;
+    const uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/*
+    Delete those of the given keys which are in a map holding the
+    entries of only some of the cgroups, about hint of them. The keys
+    of the map are read first, so that the delete takes a single batch
+    however many of the keys are missing. Returns the number of keys
+    deleted.
+*/
+static int map_delete_present(int fd, uint32_t hint, size_t value_size, const uint64_t *keys, uint32_t nr_keys){
+    uint64_t *map_keys = NULL;
+    void *values = NULL;
+    uint64_t *present = NULL;
+    uint32_t nr_present = 0;
+    int rc = map_read_alloc(fd, hint, value_size, &map_keys, &values);
+    if(rc < 0){
+        goto out_free;
+    }
+    const uint32_t nr_map_keys = rc;
+    present = calloc(nr_keys, sizeof(uint64_t));
+    if(!present){
+        rc = -ENOMEM;
+        goto out_free;
+    }
+    qsort(map_keys, nr_map_keys, sizeof(uint64_t), cg_id_cmp);
+    for(uint32_t i = 0; i < nr_keys; i++){
+        if(bsearch(&keys[i], map_keys, nr_map_keys, sizeof(uint64_t), cg_id_cmp)){
+            present[nr_present++] = keys[i];
+        }
+    }
+    rc = map_delete_all(fd, present, nr_present);
+
+out_free:
+    free(present);
+    free(values);
+    free(map_keys);
+    return rc;
+}
+
+static int bpf_map_create_cfg(uint32_t max_entries){
+    union bpf_attr attr = {
+        .map_type = BPF_MAP_TYPE_HASH,
+        .key_size = sizeof(uint64_t),
+        .value_size = sizeof(struct rate_limit_cfg),
+        .max_entries = max_entries,
+        .map_flags = BPF_F_RDONLY_PROG,
+        .map_name = "rate_limit_cfgs",
+    };
+    int rc;
+    rc = sys_bpf(BPF_MAP_CREATE, &attr, sizeof(attr));
+    if(rc < 0){
+        rc = -errno;
+    }
+    return rc;
+}
+
+/*
+    Build a new generation of the config map, holding the current
+    config with the nr entries of cg_ids and cfgs added or replaced,
+    and make it the one used by the BPF program with a single update of
+    rate_limit_map. Packets see either the old or the new generation
+    as a whole. The new map has at least capacity entries, more if the
+    entries need them, but never more than the state maps.
+*/
+static int cfg_map_swap(uint32_t capacity, const uint64_t *cg_ids, const struct rate_limit_cfg *cfgs, uint32_t nr){
+    uint64_t *old_cg_ids = NULL;
+    struct rate_limit_cfg *old_cfgs = NULL;
+    uint32_t nr_old = 0;
+    int new_fd = -1;
+    int rc = 0;
+
+    if(cfg_map_fd >= 0){
+        old_cg_ids = calloc(cfg_map_capacity, sizeof(uint64_t));
+        old_cfgs = calloc(cfg_map_capacity, sizeof(struct rate_limit_cfg));
+        if(!old_cg_ids || !old_cfgs){
+            rc = -ENOMEM;
+            goto out_free;
+        }
+        rc = map_read_all(cfg_map_fd, cfg_map_capacity, old_cg_ids, old_cfgs, sizeof(struct rate_limit_cfg));
+        if(rc < 0){
+            log_error("map_read_all(cfg) failed: %s", strerror(-rc));
+            goto out_free;
+        }
+        nr_old = rc;
+    }
+    // Replaced entries are counted twice, which only errs on the large side
+    while(capacity < nr_old + nr && capacity < state_map_capacity){
+        capacity *= 2;
+    }
+    if(capacity > state_map_capacity){
+        capacity = state_map_capacity;
+    }
+
+    rc = bpf_map_create_cfg(capacity);
+    if(rc < 0){
+        log_error("bpf_map_create_cfg(%u) failed: %s", capacity, strerror(-rc));
+        goto out_free;
+    }
+    new_fd = rc;
+    rc = map_update_all(new_fd, old_cg_ids, old_cfgs, sizeof(struct rate_limit_cfg), nr_old);
+    if(rc == 0){
+        rc = map_update_all(new_fd, cg_ids, cfgs, sizeof(struct rate_limit_cfg), nr);
+    }
+    if(rc == -E2BIG){
+        log_error("more than %u limited cgroups", state_map_capacity);
+        goto out_free;
+    }else if(rc < 0){
+        log_error("map_update_all(cfg) failed: %s", strerror(-rc));
+        goto out_free;
+    }
+
+    const uint32_t slot = 0;
+    rc = bpf_map_update_elem(bpf_map__fd(cg_rl_skel->maps.rate_limit_map), &slot, &new_fd, BPF_ANY);
+    if(rc < 0){
+        log_error("bpf_map_update_elem(rate_limit_map) failed: %s", strerror(-rc));
+        goto out_free;
+    }
+    if(cfg_map_fd >= 0){
+        if(capacity != cfg_map_capacity){
+            log_info("config map grown from %u to %u entries", cfg_map_capacity, capacity);
+        }
+        close(cfg_map_fd);
+    }
+    cfg_map_fd = new_fd;
+    cfg_map_capacity = capacity;
+    new_fd = -1;
+    rc = 0;
+
+out_free:
+    if(new_fd >= 0){
+        close(new_fd);
+    }
+    free(old_cfgs);
+    free(old_cg_ids);
+    return rc;
+}
+
+static int percpu_share_init(uint64_t cg_id){
+    struct rate_limit_share shares[nr_cpus];
+    for(int i = 0; i < nr_cpus; i++){
+        shares[i] = (struct rate_limit_share){
+            .delay_scale = RATE_LIMIT_SHARE_ONE * nr_cpus,
+            .charged_snapshot = 0,
+        };
+    }
+    int rc = 0;
+    rc = bpf_map_update_elem(bpf_map__fd(cg_rl_skel->maps.rate_limit_share_map), &cg_id, shares, BPF_NOEXIST);
+    if(rc == 0){
+        nr_percpu_cgroups++;
+    }else if(rc == -EEXIST){
+        rc = 0;
+    }
+    return rc;
+}
+
+static void percpu_share_clear(uint64_t cg_id){
+    int rc = 0;
+    rc = bpf_map_delete_elem(bpf_map__fd(cg_rl_skel->maps.rate_limit_share_map), &cg_id);
+    if(rc == 0){
+        nr_percpu_cgroups--;
+    }else if(rc != -ENOENT){
+        log_error("bpf_map_delete_elem(share) failed: %s (ignored)", strerror(-rc));
+    }
+    rc = bpf_map_delete_elem(bpf_map__fd(cg_rl_skel->maps.rate_limit_shard_map), &cg_id);
+    if(rc < 0 && rc != -ENOENT){
+        log_error("bpf_map_delete_elem(shard) failed: %s (ignored)", strerror(-rc));
+    }
+}
+
+#define NS_PER_SEC 1000000000ull
+#define RECIP_MAX_SHIFT 32
+#define RECIP_MAX_MULT (1ull << 44)
+
+/*
+    Fixed-point reciprocal of rate, so that the BPF program computes
+    delays with a multiply and a shift instead of a 64-bit division.
+
+    The product units * mult must not overflow for up to 2^20 units
+    (bytes of a BIG TCP packet or GSO segments), so mult stays below
+    2^44 and the largest shift up to 32 meeting that is chosen. The
+    relative error of mult is at most 2^-(log2(mult)+1):
+
+        1 Kbit/s    8e6 ns/byte    shift 21  exact
+        1 Mbit/s    8e3 ns/byte    shift 31  exact
+        1 Gbit/s    8 ns/byte      shift 32  exact
+        100 Gbit/s  0.08 ns/byte   shift 32  9.3e-10
+        400 Gbit/s  0.02 ns/byte   shift 32  9.3e-10
+        1 pps       1e9 ns/packet  shift 14  exact
+
+    Over the whole range the reciprocal is far more precise than the
+    rounding of each delay to whole ns, which is unchanged from the
+    division it replaces.
+*/
+static struct rate_limit_recip rate_recip(uint64_t rate){
+    struct rate_limit_recip recip = {0};
+    if(rate == 0 || rate == RATE_UNLIMITED){
+        return recip;
+    }
+    unsigned __int128 mult = 0;
+    int shift;
+    for(shift = RECIP_MAX_SHIFT; shift > 0; shift--){
+        mult = (((unsigned __int128)NS_PER_SEC << shift) + rate / 2) / rate;
+        if(mult < RECIP_MAX_MULT){
+            break;
+        }
+    }
+    if(shift == 0){
+        mult = (NS_PER_SEC + rate / 2) / rate;
+    }
+    recip.mult = mult;
+    recip.shift = shift;
+    return recip;
+}
+
+// Time needed to send burst at rate, RATE_UNLIMITED if it is not bounded
+static uint64_t burst_window_ns(uint64_t burst, uint64_t rate){
+    if(rate == 0 || rate == RATE_UNLIMITED){
+        return RATE_UNLIMITED;
+    }
+    unsigned __int128 window = (unsigned __int128)burst * NS_PER_SEC / rate;
+    return window >= RATE_UNLIMITED ? RATE_UNLIMITED : (uint64_t)window;
+}
+
+/*
+    Depth of a policing bucket which was given no burst: the window of
+    RATE_LIMIT_DEFAULT_POLICE_BURST_NS, widened to hold at least
+    RATE_LIMIT_MIN_POLICE_BURST bytes at slow rates.
+*/
+static uint64_t police_burst_ns(uint64_t byte_rate){
+    const uint64_t min_burst_ns = burst_window_ns(RATE_LIMIT_MIN_POLICE_BURST, byte_rate);
+    if(min_burst_ns == RATE_UNLIMITED || min_burst_ns < RATE_LIMIT_DEFAULT_POLICE_BURST_NS){
+        return RATE_LIMIT_DEFAULT_POLICE_BURST_NS;
+    }
+    return min_burst_ns;
+}
+
+static void rate_limit_cfg_init(struct rate_limit_cfg *cfg, const struct rate_limit *limit){
+    cfg->limit = *limit;
+    cfg->params.ns_per_byte = rate_recip(limit->byte_rate);
+    cfg->params.ns_per_pkt = rate_recip(limit->packet_rate);
+    cfg->params.ns_per_ctrl_pkt = rate_recip(limit->ctrl_packet_rate);
+    if(limit->ceil_byte_rate == 0 || limit->ceil_byte_rate <= limit->byte_rate){
+        cfg->limit.pool_id = 0;
+    }
+    cfg->params.ns_per_ceil_byte = rate_recip(limit->ceil_byte_rate);
+    cfg->params.ns_per_post_quota_byte = rate_recip(limit->post_quota_byte_rate);
+    /*
+        Both dimensions share one reservation timestamp, so the credit
+        is bounded by whichever burst drains first. A dimension without
+        a burst does not bound it, pure pacing needs both to be 0.
+    */
+    const uint64_t burst_ns_byte = limit->burst_bytes != 0 ? burst_window_ns(limit->burst_bytes, limit->byte_rate) : RATE_UNLIMITED;
+    const uint64_t burst_ns_pkt = limit->burst_packets != 0 ? burst_window_ns(limit->burst_packets, limit->packet_rate) : RATE_UNLIMITED;
+    cfg->params.burst_ns = burst_ns_pkt < burst_ns_byte ? burst_ns_pkt : burst_ns_byte;
+    if(cfg->params.burst_ns == RATE_UNLIMITED){
+        // Without a horizon to queue in, a policer without a bucket would drop every burst of TCP
+        cfg->params.burst_ns = attach_mode == DATAPATH_ATTACH_CGROUP_POLICE ? police_burst_ns(limit->byte_rate) : 0;
+    }
+    cfg->params.horizon_ns = limit->drop_horizon_ns == 0 ? RATE_LIMIT_DEFAULT_HORIZON_NS : limit->drop_horizon_ns;
+    if(cfg->params.horizon_ns > RATE_LIMIT_MAX_HORIZON_NS){
+        cfg->params.horizon_ns = RATE_LIMIT_MAX_HORIZON_NS;
+    }
+    cfg->params.ecn_threshold_ns = limit->ecn_threshold_ns == 0 ? RATE_UNLIMITED : limit->ecn_threshold_ns;
+    cfg->params.ns_per_ingress_byte = rate_recip(limit->ingress_byte_rate);
+    if(limit->ingress_burst_bytes != 0){
+        cfg->params.ingress_burst_ns = burst_window_ns(limit->ingress_burst_bytes, limit->ingress_byte_rate);
+    }else{
+        cfg->params.ingress_burst_ns = police_burst_ns(limit->ingress_byte_rate);
+    }
+}
+
+/*
+    The config is written by the BPF program cgroup_rate_limit_cgrp_set,
+    as the syscall could only replace the whole storage, and with it the
+    pacing state the datapath writes meanwhile.
+*/
+static int cgrp_storage_update(uint64_t cg_id, const struct rate_limit_cfg *cfg){
+    int retval = 0;
+    cg_rl_skel->bss->rate_limit_set_cfg = *cfg;
+    cg_rl_skel->bss->rate_limit_set_cgid = cg_id;
+    int rc = bpf_prog_run(bpf_program__fd(cg_rl_skel->progs.cgroup_rate_limit_cgrp_set), &retval);
+    if(rc < 0){
+        log_error("bpf_prog_run(cgrp_set) failed: %s", strerror(-rc));
+        return rc;
+    }
+    if(retval < 0){
+        log_error("no cgroup local storage for cgroup %lu", cg_id);
+        return -ENOENT;
+    }
+    return 0;
+}
+
+// Config in use of the cgroup local storage
+static int cgrp_storage_lookup(int cg_fd, struct rate_limit_cfg *cfg, struct rate_limit_priv *priv){
+    struct rate_limit_storage storage;
+    int rc = bpf_lookup_elem(bpf_map__fd(cg_rl_skel->maps.rate_limit_cgrp_storage), &cg_fd, &storage);
+    if(rc < 0){
+        return rc;
+    }
+    if(storage.cfg_active == 0){
+        return -ENOENT;
+    }
+    *cfg = storage.cfg[storage.cfg_active - 1];
+    if(priv){
+        *priv = storage.priv;
+    }
+    return 0;
+}
+
+static int cgrp_storage_delete(uint64_t cg_id){
+    int cg_fd = cg_id_open(cg_id);
+    if(cg_fd == -ESTALE || cg_fd == -ENOENT){
+        // The cgroup is gone, and the storage with it
+        return 0;
+    }else if(cg_fd < 0){
+        log_error("cg_id_open(%lu) failed: %s", cg_id, strerror(-cg_fd));
+        return cg_fd;
+    }
+    int rc = 0;
+    rc = bpf_map_delete_elem(bpf_map__fd(cg_rl_skel->maps.rate_limit_cgrp_storage), &cg_fd);
+    if(rc == -ENOENT){
+        rc = 0;
+    }else if(rc < 0){
         log_error("bpf_map_delete_elem() failed: %s", strerror(-rc));
+    }
+    close(cg_fd);
+    return rc;
+}
+
+static int cgroup_rate_limit_lookup(uint64_t cg_id, struct rate_limit_cfg *cfg){
+    int rc = 0;
+    if(use_cgrp_storage){
+        int cg_fd = cg_id_open(cg_id);
+        if(cg_fd == -ESTALE){
+            return -ENOENT;
+        }else if(cg_fd < 0){
+            log_error("cg_id_open(%lu) failed: %s", cg_id, strerror(-cg_fd));
+            return cg_fd;
+        }
+        rc = cgrp_storage_lookup(cg_fd, cfg, NULL);
+        close(cg_fd);
+    }else{
+        rc = bpf_lookup_elem(cfg_map_fd, &cg_id, cfg);
+    }
+    if(rc < 0 && rc != -ENOENT){
+        log_error("bpf_lookup_elem() failed: %s", strerror(-rc));
+    }
+    return rc;
+}
+
+/*
+    The BPF program only walks the levels of the hierarchy on which
+    some cgroup is limited.
+*/
+static void level_ref(int level){
+    if(level < 0 || level >= RATE_LIMIT_MAX_LEVELS){
+        return;
+    }
+    if(level_refs[level]++ == 0){
+        cg_rl_skel->bss->rate_limit_level_mask |= 1u << level;
+    }
+}
+
+static void level_unref(int level){
+    if(level < 0 || level >= RATE_LIMIT_MAX_LEVELS){
+        return;
+    }
+    assert(level_refs[level] > 0);
+    if(--level_refs[level] == 0){
+        cg_rl_skel->bss->rate_limit_level_mask &= ~(1u << level);
+    }
+}
+
+static int rx_window_find(uint64_t cg_id){
+    for(uint32_t i = 0; i < nr_rx_window_links; i++){
+        if(rx_window_links[i].cg_id == cg_id){
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+    Attach the sock_ops program to the cgroup, if not yet, and store the
+    rate in its cgroup storage, which exists as long as it is attached.
+    Connections established before are not clamped, so this is done
+    before the task is started.
+*/
+static int rx_window_attach(uint64_t cg_id, uint64_t byte_rate){
+    int rc = 0;
+    if(rx_window_find(cg_id) < 0){
+        struct rx_window_link *links = realloc(rx_window_links, (nr_rx_window_links + 1) * sizeof(struct rx_window_link));
+        if(links == NULL){
+            return -errno;
+        }
+        rx_window_links = links;
+        int cg_fd = cg_id_open(cg_id);
+        if(cg_fd < 0){
+            log_error("cg_id_open(%lu) failed: %s", cg_id, strerror(-cg_fd));
+            return cg_fd;
+        }
+        struct bpf_link *link = bpf_program__attach_cgroup(cg_rl_skel->progs.cgroup_rate_limit_rx_window, cg_fd);
+        if(!link){
+            rc = -errno;
+        }
+        close(cg_fd);
+        if(rc < 0){
+            log_error("bpf_program__attach_cgroup() failed: %s", strerror(-rc));
+            return rc;
+        }
+        rx_window_links[nr_rx_window_links++] = (struct rx_window_link){.cg_id = cg_id, .link = link};
+    }
+
+    // The BPF program counts the connections from here on, an update keeps the count
+    const __s64 nr_conns = 0;
+    rc = bpf_map_update_elem(bpf_map__fd(cg_rl_skel->maps.rate_limit_rx_conns_map), &cg_id, &nr_conns, BPF_NOEXIST);
+    if(rc < 0 && rc != -EEXIST){
+        log_error("bpf_map_update_elem(rx connections) failed: %s", strerror(-rc));
+        return rc;
+    }
+
+    const int map_fd = bpf_map__fd(cg_rl_skel->maps.rate_limit_rx_cgroup);
+    struct bpf_cgroup_storage_key key;
+    memset(&key, 0, sizeof(key));
+    key.cgroup_inode_id = cg_id;
+    key.attach_type = BPF_CGROUP_SOCK_OPS;
+    const struct rate_limit_rx_window rxw = {.byte_rate = byte_rate, .cgroup_id = cg_id};
+    rc = bpf_map_update_elem(map_fd, &key, &rxw, BPF_EXIST);
+    if(rc < 0){
+        log_error("bpf_map_update_elem(rx window) failed: %s", strerror(-rc));
+    }
+    return rc;
+}
+
+// Connections keep their clamp, but new ones are no longer clamped
+static void rx_window_detach(uint64_t cg_id){
+    const int i = rx_window_find(cg_id);
+    if(i < 0){
+        return;
+    }
+    bpf_link__destroy(rx_window_links[i].link);
+    rx_window_links[i] = rx_window_links[--nr_rx_window_links];
+    bpf_map_delete_elem(bpf_map__fd(cg_rl_skel->maps.rate_limit_rx_conns_map), &cg_id);
+}
+
+static bool ingress_limited(const struct rate_limit *limit){
+    return limit->ingress_byte_rate != 0 && limit->ingress_byte_rate != RATE_UNLIMITED;
+}
+
+/*
+    Track whether cgroup cg_id is policed on ingress. Sockets are only
+    looked up on ingress while some cgroup is.
+*/
+static int ingress_cgroup_update(uint64_t cg_id, bool limited){
+    uint32_t i;
+    for(i = 0; i < nr_ingress_cgroups; i++){
+        if(ingress_cgroups[i] == cg_id){
+            break;
+        }
+    }
+    if(limited && i == nr_ingress_cgroups){
+        if(nr_ingress_cgroups == ingress_cgroups_capacity){
+            const uint32_t capacity = ingress_cgroups_capacity ? ingress_cgroups_capacity * 2 : 16;
+            uint64_t *new_cgroups = realloc(ingress_cgroups, capacity * sizeof(uint64_t));
+            if(new_cgroups == NULL){
+                return -errno;
+            }
+            ingress_cgroups = new_cgroups;
+            ingress_cgroups_capacity = capacity;
+        }
+        ingress_cgroups[nr_ingress_cgroups++] = cg_id;
+    }else if(!limited && i < nr_ingress_cgroups){
+        ingress_cgroups[i] = ingress_cgroups[--nr_ingress_cgroups];
+    }
+    cg_rl_skel->bss->rate_limit_nr_ingress = nr_ingress_cgroups;
+    return 0;
+}
+
+static int pending_delete_find(uint64_t cg_id){
+    for(uint32_t i = 0; i < nr_pending_deletes; i++){
+        if(pending_deletes[i] == cg_id){
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int pending_delete_add(uint64_t cg_id){
+    if(nr_pending_deletes == pending_deletes_capacity){
+        const uint32_t capacity = pending_deletes_capacity ? pending_deletes_capacity * 2 : 64;
+        uint64_t *new_pending = realloc(pending_deletes, capacity * sizeof(uint64_t));
+        if(new_pending == NULL){
+            return -errno;
+        }
+        pending_deletes = new_pending;
+        pending_deletes_capacity = capacity;
+    }
+    pending_deletes[nr_pending_deletes++] = cg_id;
+    return 0;
+}
+
+static bool pending_delete_cancel(uint64_t cg_id){
+    const int i = pending_delete_find(cg_id);
+    if(i < 0){
+        return false;
+    }
+    pending_deletes[i] = pending_deletes[--nr_pending_deletes];
+    return true;
+}
+
+/*
+    Name of a disabled feature the limit depends on, or NULL. Features
+    which only tune the limit, like burst and ECN, are just ignored.
+*/
+static const char *rate_limit_disabled_feature(const struct rate_limit *limit){
+    const struct {
+        uint32_t feature;
+        bool used;
+        const char *name;
+    } uses[] = {
+        {RATE_LIMIT_FEAT_BYTE_RATE, limit->byte_rate != 0 && limit->byte_rate != RATE_UNLIMITED, "byte rate"},
+        {RATE_LIMIT_FEAT_PACKET_RATE, limit->packet_rate != 0 && limit->packet_rate != RATE_UNLIMITED, "packet rate"},
+        {RATE_LIMIT_FEAT_CTRL, limit->ctrl_packet_rate != 0, "control packet rate"},
+        {RATE_LIMIT_FEAT_QUOTA, limit->quota_bytes != 0, "quota"},
+        {RATE_LIMIT_FEAT_BORROW, limit->pool_id != 0, "borrowing"},
+        {RATE_LIMIT_FEAT_FLOW_FAIR, limit->flags & RATE_LIMIT_F_FLOW_FAIR, "flow fairness"},
+        {RATE_LIMIT_FEAT_PERCPU, limit->flags & RATE_LIMIT_F_PERCPU, "per-CPU buckets"},
+        {RATE_LIMIT_FEAT_INGRESS, ingress_limited(limit) && !(limit->flags & RATE_LIMIT_F_RX_WINDOW), "ingress policing"},
+        {RATE_LIMIT_FEAT_RX_WINDOW, limit->flags & RATE_LIMIT_F_RX_WINDOW, "receive window clamping"},
+    };
+    for(size_t i = 0; i < sizeof(uses) / sizeof(uses[0]); i++){
+        if(uses[i].used && (disabled_features & uses[i].feature)){
+            return uses[i].name;
+        }
+    }
+    return NULL;
+}
+
+/*
+    Level of the cgroup in the hierarchy as the BPF program counts it,
+    the root being level 0. The path of the cgroup is relative to the
+    cgroup namespace of the daemon, so the level is asked from the
+    kernel if bpf_cgroup_from_id() is available and only counted from
+    path otherwise.
+*/
+int cgroup_rate_limit_level(uint64_t cg_id, const char *path){
+    if(!use_cgrp_storage){
+        return cg_path_get_level(path);
+    }
+    int level = 0;
+    cg_rl_skel->bss->rate_limit_level_cgid = cg_id;
+    int rc = bpf_prog_run(bpf_program__fd(cg_rl_skel->progs.cgroup_rate_limit_level), &level);
+    if(rc < 0){
+        log_error("bpf_prog_run(level) failed: %s", strerror(-rc));
+        return rc;
+    }
+    if(level < 0){
+        return -ENOENT;
+    }
+    return level;
+}
+
+/*
+    Create the pacing state and counters of cgroups which are newly
+    limited. The BPF program would only create them on the first packet,
+    this way cgroup_rate_limit_flush() knows that every limited cgroup
+    has them.
+*/
+static int state_entries_create(const uint64_t *cg_ids, uint32_t nr){
+    const size_t stats_size = nr_cpus * sizeof(struct rate_limit_stats);
+    int rc = 0;
+    if(nr == 0){
+        return 0;
+    }
+    // Zeroes, a zero timestamp starts the cgroup with full burst credit
+    void *values = calloc(nr, stats_size);
+    if(!values){
+        return -ENOMEM;
+    }
+    if(!use_cgrp_storage){
+        rc = map_update_all(bpf_map__fd(cg_rl_skel->maps.rate_limit_priv_map), cg_ids, values, sizeof(struct rate_limit_priv), nr);
+        if(rc < 0){
+            log_error("map_update_all(priv) failed: %s", strerror(-rc));
+            goto out_free;
+        }
+    }
+    if(!(disabled_features & RATE_LIMIT_FEAT_STATS)){
+        rc = map_update_all(bpf_map__fd(cg_rl_skel->maps.rate_limit_stats_map), cg_ids, values, stats_size, nr);
+        if(rc < 0){
+            log_error("map_update_all(stats) failed: %s", strerror(-rc));
+            goto out_free;
+        }
+    }
+out_free:
+    free(values);
+    return rc;
+}
+
+/*
+    A cgroup whose limit is being set, from the checks to the
+    bookkeeping once its config is in place.
+*/
+struct cfg_update {
+    uint64_t cg_id;
+    int level;
+    const struct rate_limit *limit;
+    struct rate_limit_cfg cfg;
+    bool is_new;
+    bool was_pending;
+    bool was_percpu;
+};
+
+// Not limited before, and without entries left to delete
+static bool cfg_update_fresh(const struct cfg_update *u){
+    return u->is_new && !u->was_pending;
+}
+
+/*
+    Check the limit and create the entries its config relies on, before
+    the config itself is written.
+*/
+static int cfg_update_prepare(struct cfg_update *u){
+    int rc = 0;
+    const struct rate_limit *limit = u->limit;
+    const char *disabled = rate_limit_disabled_feature(limit);
+    if(disabled){
+        log_error("%s is disabled in the datapath", disabled);
+        rc = -EOPNOTSUPP;
+        goto fail;
+    }
+    if((limit->flags & RATE_LIMIT_F_RX_WINDOW) && !ingress_limited(limit)){
+        log_error("receive window clamping needs an ingress rate");
+        rc = -EINVAL;
+        goto fail;
+    }
+    if(limit->pool_id != 0 && (limit->pool_id >= RATE_LIMIT_MAX_POOLS || !pool_configured[limit->pool_id])){
+        log_error("borrowing pool %lu is not configured", limit->pool_id);
+        rc = -EINVAL;
+        goto fail;
+    }
+    rc = cgroup_rate_limit_lookup(u->cg_id, &u->cfg);
+    if(rc < 0 && rc != -ENOENT){
         goto fail;
     }
+    // Unset earlier in this iteration of the event loop, but not deleted yet
+    u->was_pending = pending_delete_find(u->cg_id) >= 0;
+    u->is_new = rc == -ENOENT || u->was_pending;
+    u->was_percpu = rc == 0 && (u->cfg.limit.flags & RATE_LIMIT_F_PERCPU);
+    rate_limit_cfg_init(&u->cfg, limit);
+    if(limit->quota_bytes != 0){
+        // Usage counts on from where it was if the cgroup already had a quota
+        const uint64_t sent_bytes = 0;
+        rc = bpf_map_update_elem(bpf_map__fd(cg_rl_skel->maps.rate_limit_quota_map), &u->cg_id, &sent_bytes, BPF_NOEXIST);
+        if(rc == 0){
+            nr_quota_cgroups++;
+        }else if(rc != -EEXIST){
+            log_error("bpf_map_update_elem(quota) failed: %s", strerror(-rc));
+            goto fail;
+        }
+    }
+    if(limit->flags & RATE_LIMIT_F_PERCPU){
+        rc = percpu_share_init(u->cg_id);
+        if(rc < 0){
+            log_error("percpu_share_init() failed: %s", strerror(-rc));
+            goto fail;
+        }
+    }
+    rc = 0;
 fail:
     return rc;
 }
 
-int cgroup_rate_limit_check(uint64_t cg_id){
-    struct rate_limit limit;
+// Bookkeeping of a cgroup whose config has been written
+static int cfg_update_commit(const struct cfg_update *u){
+    const struct rate_limit *limit = u->limit;
     int rc = 0;
-    rc = bpf_lookup_elem(bpf_map__fd(cg_rl_skel->maps.rate_limit_map), &cg_id, &limit);
+    // Cancelled only now so that a failed update still deletes the entries
+    if(u->was_pending){
+        pending_delete_cancel(u->cg_id);
+    }
+    if(u->was_percpu && !(limit->flags & RATE_LIMIT_F_PERCPU)){
+        percpu_share_clear(u->cg_id);
+    }
+    if(u->is_new){
+        level_ref(u->level);
+    }
+    if(limit->flags & RATE_LIMIT_F_RX_WINDOW){
+        rc = rx_window_attach(u->cg_id, limit->ingress_byte_rate);
+        if(rc < 0){
+            goto fail;
+        }
+    }else{
+        rx_window_detach(u->cg_id);
+    }
+    rc = ingress_cgroup_update(u->cg_id, ingress_limited(limit) && !(limit->flags & RATE_LIMIT_F_RX_WINDOW));
+fail:
+    return rc;
+}
 
+/*
+    level is the level of the cgroup if its limit also covers the
+    packets of its descendants, -1 if it only covers its own sockets.
+*/
+int cgroup_rate_limit_set(uint64_t cg_id, int level, const struct rate_limit *limit){
+    struct cfg_update u = {.cg_id = cg_id, .level = level, .limit = limit};
+    int rc = 0;
+    rc = cfg_update_prepare(&u);
     if(rc < 0){
-        if(rc == -ENOENT){
-            rc = 0;
-        }else{
-            log_error("bpf_lookup_elem() failed: %s", strerror(-rc));
+        goto fail;
+    }
+    if(cfg_update_fresh(&u)){
+        rc = state_entries_create(&cg_id, 1);
+        if(rc < 0){
+            goto fail;
+        }
+    }
+    if(use_cgrp_storage){
+        rc = cgrp_storage_update(cg_id, &u.cfg);
+        if(rc < 0){
+            goto fail;
         }
     }else{
-        rc = 1;
+        rc = bpf_map_update_elem(cfg_map_fd, &cg_id, &u.cfg, BPF_ANY);
+        if(rc == -E2BIG){
+            rc = cfg_map_swap(cfg_map_capacity * 2, &cg_id, &u.cfg, 1);
+        }else if(rc < 0){
+            log_error("bpf_map_update_elem() failed: %s", strerror(-rc));
+        }
+        if(rc < 0){
+            goto fail;
+        }
+    }
+    return cfg_update_commit(&u);
+
+fail:
+    // What was created for a new cgroup goes with the next flush
+    if(cfg_update_fresh(&u)){
+        pending_delete_add(cg_id);
+    }
+    return rc;
+}
+
+/*
+    Set the limits of nr distinct cgroups at once. With the hash maps
+    they are swapped in as one new generation of the config map, so
+    that packets never see some of the new limits with the old others,
+    as when the rates of a group of cgroups are divided anew. Cgroup
+    local storage has no generations, there the limits are written one
+    after the other. If not all of them could be written, the cgroups
+    which were not limited before are left unlimited.
+*/
+int cgroup_rate_limit_set_many(const struct rate_limit_update *updates, uint32_t nr){
+    struct cfg_update *u = calloc(nr, sizeof(struct cfg_update));
+    uint64_t *cg_ids = calloc(nr, sizeof(uint64_t));
+    uint64_t *fresh_cg_ids = calloc(nr, sizeof(uint64_t));
+    struct rate_limit_cfg *cfgs = calloc(nr, sizeof(struct rate_limit_cfg));
+    uint32_t nr_prepared = 0, nr_fresh = 0, nr_set = 0;
+    int rc = 0;
+    if(!u || !cg_ids || !fresh_cg_ids || !cfgs){
+        rc = -ENOMEM;
+        goto out_free;
+    }
+    for(uint32_t i = 0; i < nr; i++){
+        u[i] = (struct cfg_update){
+            .cg_id = updates[i].cg_id,
+            .level = updates[i].level,
+            .limit = &updates[i].limit,
+        };
+        nr_prepared++;
+        rc = cfg_update_prepare(&u[i]);
+        if(rc < 0){
+            goto out_free;
+        }
+        cg_ids[i] = u[i].cg_id;
+        cfgs[i] = u[i].cfg;
+        if(cfg_update_fresh(&u[i])){
+            fresh_cg_ids[nr_fresh++] = u[i].cg_id;
+        }
+    }
+    rc = state_entries_create(fresh_cg_ids, nr_fresh);
+    if(rc < 0){
+        goto out_free;
+    }
+    if(use_cgrp_storage){
+        for(; nr_set < nr; nr_set++){
+            rc = cgrp_storage_update(u[nr_set].cg_id, &u[nr_set].cfg);
+            if(rc < 0){
+                goto out_free;
+            }
+        }
+    }else{
+        rc = cfg_map_swap(cfg_map_capacity, cg_ids, cfgs, nr);
+        if(rc < 0){
+            goto out_free;
+        }
+        nr_set = nr;
+    }
+    for(uint32_t i = 0; i < nr; i++){
+        rc = cfg_update_commit(&u[i]);
+        if(rc < 0){
+            goto out_free;
+        }
+    }
+
+out_free:
+    // Unless all limits were written, the new cgroups are left unlimited
+    for(uint32_t i = 0; rc < 0 && nr_set < nr && i < nr_prepared; i++){
+        if(i < nr_set && u[i].is_new){
+            cgrp_storage_delete(u[i].cg_id);
+        }
+        if(cfg_update_fresh(&u[i])){
+            pending_delete_add(u[i].cg_id);
+        }
+    }
+    free(cfgs);
+    free(fresh_cg_ids);
+    free(cg_ids);
+    free(u);
+    return rc;
+}
+
+/*
+    The entries of the cgroup in the hash maps are only deleted by
+    cgroup_rate_limit_flush(), together with those of the other cgroups
+    unset meanwhile.
+*/
+int cgroup_rate_limit_unset(uint64_t cg_id, int level){
+    int rc = 0;
+    if(use_cgrp_storage){
+        rc = cgrp_storage_delete(cg_id);
+        if(rc < 0){
+            goto fail;
+        }
+    }
+    rc = pending_delete_add(cg_id);
+    if(rc < 0){
+        goto fail;
+    }
+    level_unref(level);
+    ingress_cgroup_update(cg_id, false);
+    rx_window_detach(cg_id);
+    rc = 0;
+fail:
+    return rc;
+}
+
+/*
+    Delete the entries of the cgroups unset since the last call with
+    one batch per map. Called once per iteration of the event loop.
+*/
+int cgroup_rate_limit_flush(void){
+    if(nr_pending_deletes == 0){
+        return 0;
+    }
+    const uint64_t nr_syscalls_before = nr_bpf_syscalls;
+    int rc = 0;
+    // Every limited cgroup has a config, pacing state and counters
+    if(!use_cgrp_storage){
+        rc = map_delete_all(cfg_map_fd, pending_deletes, nr_pending_deletes);
+        if(rc < 0){
+            log_error("map_delete_all() failed: %s", strerror(-rc));
+            // Keep them pending so that the limit is removed later
+            return rc;
+        }
+        rc = map_delete_all(bpf_map__fd(cg_rl_skel->maps.rate_limit_priv_map), pending_deletes, nr_pending_deletes);
+        if(rc < 0){
+            log_error("map_delete_all(priv) failed: %s (ignored)", strerror(-rc));
+        }
+    }
+    if(!(disabled_features & RATE_LIMIT_FEAT_STATS)){
+        rc = map_delete_all(bpf_map__fd(cg_rl_skel->maps.rate_limit_stats_map), pending_deletes, nr_pending_deletes);
+        if(rc < 0){
+            log_error("map_delete_all(stats) failed: %s (ignored)", strerror(-rc));
+        }
+    }
+    // Only some have per-CPU shares or a quota
+    if(nr_percpu_cgroups > 0){
+        rc = map_delete_present(bpf_map__fd(cg_rl_skel->maps.rate_limit_share_map), nr_percpu_cgroups,
+            nr_cpus * sizeof(struct rate_limit_share), pending_deletes, nr_pending_deletes);
+        if(rc < 0){
+            log_error("map_delete_present(share) failed: %s (ignored)", strerror(-rc));
+        }else{
+            nr_percpu_cgroups -= rc;
+        }
+        rc = map_delete_present(bpf_map__fd(cg_rl_skel->maps.rate_limit_shard_map), nr_percpu_cgroups,
+            nr_cpus * sizeof(struct rate_limit_shard), pending_deletes, nr_pending_deletes);
+        if(rc < 0){
+            log_error("map_delete_present(shard) failed: %s (ignored)", strerror(-rc));
+        }
+    }
+    if(nr_quota_cgroups > 0){
+        rc = map_delete_present(bpf_map__fd(cg_rl_skel->maps.rate_limit_quota_map), nr_quota_cgroups,
+            sizeof(uint64_t), pending_deletes, nr_pending_deletes);
+        if(rc < 0){
+            log_error("map_delete_present(quota) failed: %s (ignored)", strerror(-rc));
+        }else{
+            nr_quota_cgroups -= rc;
+        }
+    }
+    log_trace("deleted %u cgroups with %lu bpf syscalls", nr_pending_deletes, nr_bpf_syscalls - nr_syscalls_before);
+    nr_pending_deletes = 0;
+    return 0;
+}
+
+int cgroup_rate_limit_pool_set(uint32_t pool_id, uint64_t byte_rate){
+    if(pool_id == 0 || pool_id >= RATE_LIMIT_MAX_POOLS){
+        return -EINVAL;
+    }
+    struct rate_limit_pool pool = {
+        .byte_rate = byte_rate,
+        .ns_per_byte = rate_recip(byte_rate),
+        .next_avail_ts = 0,
+    };
+    int rc = 0;
+    rc = bpf_map_update_elem(bpf_map__fd(cg_rl_skel->maps.rate_limit_pool_map), &pool_id, &pool, BPF_ANY);
+    if(rc < 0){
+        log_error("bpf_map_update_elem(pool) failed: %s", strerror(-rc));
+        return rc;
+    }
+    pool_configured[pool_id] = byte_rate != 0;
+    return 0;
+}
+
+/*
+    Charge packets sent on ifname as overhead bytes longer, and at
+    least mpu bytes. The length the datapath sees includes the Ethernet
+    header with tc, but not with the cgroup attach mode.
+*/
+int cgroup_rate_limit_iface_set(const char *ifname, int32_t overhead, uint32_t mpu){
+    assert(cg_rl_skel);
+
+    unsigned int ifindex = if_nametoindex(ifname);
+    if(ifindex == 0){
+        int rc = -errno;
+        log_error("if_nametoindex(%s) failed: %s", ifname, strerror(-rc));
+        return rc;
+    }
+    const struct rate_limit_iface iface = {
+        .overhead = overhead,
+        .mpu = mpu,
+    };
+    int rc = bpf_map_update_elem(bpf_map__fd(cg_rl_skel->maps.rate_limit_iface_map), &ifindex, &iface, BPF_ANY);
+    if(rc < 0){
+        log_error("bpf_map_update_elem(iface) failed: %s", strerror(-rc));
+        return rc;
+    }
+    return 0;
+}
+
+/*
+    Recompute the per-CPU shares of one cgroup from the delay charged
+    on each CPU since the last round. A CPU which did not use up its
+    share keeps what it used plus some headroom, the rest is split
+    evenly among the CPUs which are backlogged. The shares always sum
+    up to at most RATE_LIMIT_SHARE_ONE.
+*/
+static void percpu_rebalance_one(struct rate_limit_share *shares, const struct rate_limit_shard *shards, uint64_t now, uint64_t interval){
+    uint64_t new_share[nr_cpus];
+    int busy[nr_cpus];
+
+    uint64_t floor_share = RATE_LIMIT_SHARE_ONE / (4 * nr_cpus);
+    if(floor_share == 0){
+        floor_share = 1;
+    }
+    uint64_t idle_total = 0;
+    int nr_busy = 0;
+    for(int i = 0; i < nr_cpus; i++){
+        busy[i] = shards[i].next_avail_ts > now;
+        if(busy[i]){
+            nr_busy++;
+            continue;
+        }
+        uint64_t used = shards[i].charged_ns - shares[i].charged_snapshot;
+        used = used >= interval ? RATE_LIMIT_SHARE_ONE : (used << RATE_LIMIT_SHARE_SHIFT) / interval;
+        new_share[i] = used + used / 4;
+        if(new_share[i] < floor_share){
+            new_share[i] = floor_share;
+        }
+        idle_total += new_share[i];
+    }
+    const uint64_t budget = RATE_LIMIT_SHARE_ONE - nr_busy * floor_share;
+    if(idle_total > budget){
+        for(int i = 0; i < nr_cpus; i++){
+            if(!busy[i]){
+                new_share[i] = new_share[i] * budget / idle_total;
+                if(new_share[i] == 0){
+                    new_share[i] = 1;
+                }
+            }
+        }
+        idle_total = budget;
+    }
+    const uint64_t spare = RATE_LIMIT_SHARE_ONE - idle_total;
+    for(int i = 0; i < nr_cpus; i++){
+        if(nr_busy){
+            if(busy[i]){
+                new_share[i] = spare / nr_busy;
+            }
+        }else{
+            new_share[i] += spare / nr_cpus;
+        }
+        shares[i].delay_scale = (RATE_LIMIT_SHARE_ONE << RATE_LIMIT_SHARE_SHIFT) / new_share[i];
+        shares[i].charged_snapshot = shards[i].charged_ns;
     }
+}
+
+struct shard_index {
+    uint64_t cg_id;
+    uint32_t pos;
+};
+
+static int shard_index_cmp(const void *a, const void *b){
+    const uint64_t x = ((const struct shard_index *)a)->cg_id;
+    const uint64_t y = ((const struct shard_index *)b)->cg_id;
+    return x < y ? -1 : x > y;
+}
+
+/*
+    Recompute the shares of all per-CPU limited cgroups. The shares and
+    shards are read and the shares written back with batch operations,
+    so that a rebalance takes a few syscalls however many cgroups there
+    are.
+*/
+int cgroup_rate_limit_rebalance(void){
+    static uint64_t last_ts = 0;
+    if(nr_percpu_cgroups == 0){
+        // The timer stops, usage is measured from scratch once it is armed again
+        last_ts = 0;
+        return 0;
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    const uint64_t now = ts.tv_sec * 1000000000ull + ts.tv_nsec;
+    const uint64_t interval = now - last_ts;
+    if(last_ts == 0){
+        last_ts = now;
+        return 0;
+    }
+    last_ts = now;
+
+    const uint64_t nr_syscalls_before = nr_bpf_syscalls;
+    const int share_fd = bpf_map__fd(cg_rl_skel->maps.rate_limit_share_map);
+    const int shard_fd = bpf_map__fd(cg_rl_skel->maps.rate_limit_shard_map);
+    const size_t share_size = nr_cpus * sizeof(struct rate_limit_share);
+    const size_t shard_size = nr_cpus * sizeof(struct rate_limit_shard);
+    int rc = 0;
+
+    uint64_t *share_keys = NULL;
+    struct rate_limit_share *shares = NULL;
+    uint64_t *shard_keys = NULL;
+    struct rate_limit_shard *shards = NULL;
+    struct shard_index *index = NULL;
+
+    rc = map_read_alloc(share_fd, nr_percpu_cgroups, share_size, &share_keys, (void **)&shares);
+    if(rc < 0){
+        log_error("map_read_alloc(share) failed: %s", strerror(-rc));
+        goto out_free;
+    }
+    const uint32_t nr_shares = rc;
+    // Shards are created by the BPF program, so there may be more of them
+    rc = map_read_alloc(shard_fd, nr_percpu_cgroups, shard_size, &shard_keys, (void **)&shards);
+    if(rc < 0){
+        log_error("map_read_alloc(shard) failed: %s", strerror(-rc));
+        goto out_free;
+    }
+    const uint32_t nr_shards = rc;
+    index = calloc(nr_shards + 1, sizeof(struct shard_index));
+    if(!index){
+        rc = -ENOMEM;
+        goto out_free;
+    }
+    for(uint32_t i = 0; i < nr_shards; i++){
+        index[i] = (struct shard_index){.cg_id = shard_keys[i], .pos = i};
+    }
+    qsort(index, nr_shards, sizeof(struct shard_index), shard_index_cmp);
+
+    // Move the cgroups which have sent something to the front, for the update
+    uint32_t nr_updates = 0;
+    for(uint32_t i = 0; i < nr_shares; i++){
+        const struct shard_index key = {.cg_id = share_keys[i]};
+        const struct shard_index *found = bsearch(&key, index, nr_shards, sizeof(struct shard_index), shard_index_cmp);
+        if(!found){
+            // Nothing sent yet
+            continue;
+        }
+        struct rate_limit_share *share = shares + (size_t)nr_updates * nr_cpus;
+        if(nr_updates != i){
+            share_keys[nr_updates] = share_keys[i];
+            memcpy(share, shares + (size_t)i * nr_cpus, share_size);
+        }
+        percpu_rebalance_one(share, shards + (size_t)found->pos * nr_cpus, now, interval);
+        nr_updates++;
+    }
+    if(nr_updates > 0){
+        uint32_t count = nr_updates;
+        rc = bpf_map_update_batch(share_fd, share_keys, shares, &count, BPF_EXIST);
+        if(rc < 0){
+            log_error("bpf_map_update_batch(share) failed after %u of %u: %s", count, nr_updates, strerror(-rc));
+            goto out_free;
+        }
+    }
+    log_trace("rebalanced %u cgroups with %lu bpf syscalls", nr_updates, nr_bpf_syscalls - nr_syscalls_before);
+    rc = 0;
+
+out_free:
+    free(index);
+    free(shards);
+    free(shard_keys);
+    free(shares);
+    free(share_keys);
     return rc;
 }
+
+/*
+    Number of cgroups limited with RATE_LIMIT_F_PERCPU, which need
+    cgroup_rate_limit_rebalance() to run periodically.
+*/
+uint32_t cgroup_rate_limit_nr_percpu(void){
+    return nr_percpu_cgroups;
+}
+
+/*
+    Config and pacing state of a limited cgroup, -ENOENT if it is not
+    limited.
+*/
+int cgroup_rate_limit_query(uint64_t cg_id, struct rate_limit *limit, struct rate_limit_priv *priv){
+    int rc = 0;
+    if(use_cgrp_storage){
+        struct rate_limit_cfg cfg;
+        int cg_fd = cg_id_open(cg_id);
+        if(cg_fd < 0){
+            log_error("cg_id_open(%lu) failed: %s", cg_id, strerror(-cg_fd));
+            return cg_fd;
+        }
+        rc = cgrp_storage_lookup(cg_fd, &cfg, priv);
+        close(cg_fd);
+        if(rc < 0){
+            return rc;
+        }
+        *limit = cfg.limit;
+        return 0;
+    }
+    struct rate_limit_cfg cfg;
+    rc = bpf_lookup_elem(cfg_map_fd, &cg_id, &cfg);
+    if(rc < 0){
+        return rc;
+    }
+    *limit = cfg.limit;
+    rc = bpf_lookup_elem(bpf_map__fd(cg_rl_skel->maps.rate_limit_priv_map), &cg_id, priv);
+    if(rc == -ENOENT){
+        // Nothing sent yet
+        memset(priv, 0, sizeof(*priv));
+        rc = 0;
+    }
+    return rc;
+}
+
+// Bytes counted against the quota of a cgroup, 0 if it has none
+int cgroup_rate_limit_quota_used(uint64_t cg_id, uint64_t *sent_bytes){
+    int rc = bpf_lookup_elem(bpf_map__fd(cg_rl_skel->maps.rate_limit_quota_map), &cg_id, sent_bytes);
+    if(rc == -ENOENT){
+        *sent_bytes = 0;
+        rc = 0;
+    }
+    return rc;
+}
+
+// Counters of a cgroup summed over all CPUs
+int cgroup_rate_limit_stats(uint64_t cg_id, struct rate_limit_stats *total){
+    int rc = 0;
+    memset(total, 0, sizeof(*total));
+    struct rate_limit_stats *stats = calloc(nr_cpus, sizeof(struct rate_limit_stats));
+    if(stats == NULL){
+        return -errno;
+    }
+    rc = bpf_lookup_elem(bpf_map__fd(cg_rl_skel->maps.rate_limit_stats_map), &cg_id, stats);
+    if(rc == -ENOENT){
+        // Nothing sent yet
+        rc = 0;
+        goto out_free_stats;
+    }else if(rc < 0){
+        log_error("bpf_lookup_elem(stats) failed: %s", strerror(-rc));
+        goto out_free_stats;
+    }
+    for(int i = 0; i < nr_cpus; i++){
+        total->passed_bytes += stats[i].passed_bytes;
+        total->passed_packets += stats[i].passed_packets;
+        total->delayed_packets += stats[i].delayed_packets;
+        total->marked_packets += stats[i].marked_packets;
+        total->dropped_bytes += stats[i].dropped_bytes;
+        total->dropped_packets += stats[i].dropped_packets;
+        total->ingress_passed_bytes += stats[i].ingress_passed_bytes;
+        total->ingress_passed_packets += stats[i].ingress_passed_packets;
+        total->ingress_dropped_bytes += stats[i].ingress_dropped_bytes;
+        total->ingress_dropped_packets += stats[i].ingress_dropped_packets;
+        total->suppressed_drops += stats[i].suppressed_drops;
+        if(stats[i].max_delay_ns > total->max_delay_ns){
+            total->max_delay_ns = stats[i].max_delay_ns;
+        }
+        for(int j = 0; j < RATE_LIMIT_DELAY_BUCKETS; j++){
+            total->delay_hist[j] += stats[i].delay_hist[j];
+        }
+    }
+out_free_stats:
+    free(stats);
+    return rc;
+}
+
+static int drop_event_sample(void *ctx, void *data, size_t size){
+    (void)ctx;
+    if(size < sizeof(struct rate_limit_drop_event)){
+        log_warn("Short drop event of %zu bytes", size);
+        return 0;
+    }
+    drop_event_handler(data);
+    return 0;
+}
+
+/*
+    Subscribe to the drop events sent by the datapath. Returns a file
+    descriptor to poll for readability, after which
+    cgroup_rate_limit_events_consume() passes the pending events to
+    handler, or -EOPNOTSUPP without ring buffer support.
+*/
+int cgroup_rate_limit_events_open(drop_event_handler_t handler){
+    assert(cg_rl_skel);
+    assert(!drop_events);
+
+    if(!use_ringbuf){
+        return -EOPNOTSUPP;
+    }
+    drop_events = ring_buffer__new(bpf_map__fd(cg_rl_skel->maps.rate_limit_events), drop_event_sample, NULL, NULL);
+    if(!drop_events){
+        int rc = -errno;
+        log_error("ring_buffer__new() failed: %s", strerror(-rc));
+        return rc;
+    }
+    drop_event_handler = handler;
+    return ring_buffer__epoll_fd(drop_events);
+}
+
+int cgroup_rate_limit_events_consume(void){
+    assert(drop_events);
+
+    int rc = ring_buffer__consume(drop_events);
+    if(rc < 0){
+        log_error("ring_buffer__consume() failed: %s", strerror(-rc));
+    }
+    return rc;
+}
+
+/*
+    Upper bound in ns of the histogram bucket holding the given quantile
+    of the delays, in permille. Delays below 1us count as 0, and the
+    bound is capped by the largest delay seen.
+*/
+uint64_t rate_limit_stats_delay_quantile(const struct rate_limit_stats *stats, unsigned int permille){
+    uint64_t total = 0;
+    for(int i = 0; i < RATE_LIMIT_DELAY_BUCKETS; i++){
+        total += stats->delay_hist[i];
+    }
+    if(total == 0){
+        return 0;
+    }
+    uint64_t rank = (total * permille + 999) / 1000;
+    if(rank == 0){
+        rank = 1;
+    }
+    uint64_t seen = 0;
+    int bucket;
+    for(bucket = 0; bucket < RATE_LIMIT_DELAY_BUCKETS - 1; bucket++){
+        seen += stats->delay_hist[bucket];
+        if(seen >= rank){
+            break;
+        }
+    }
+    if(bucket == 0){
+        return 0;
+    }
+    const uint64_t bound = (1000ull << bucket);
+    return bound < stats->max_delay_ns ? bound : stats->max_delay_ns;
+}
+
+int cgroup_rate_limit_check(uint64_t cg_id){
+    struct rate_limit_cfg cfg;
+    int rc = cgroup_rate_limit_lookup(cg_id, &cfg);
+    if(rc == -ENOENT || pending_delete_find(cg_id) >= 0){
+        return 0;
+    }else if(rc < 0){
+        return rc;
+    }
+    return 1;
+}
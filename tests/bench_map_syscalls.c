@@ -0,0 +1,215 @@
+/*
+    Counts the bpf syscalls the daemon issues for bulk changes to many
+    cgroups: setting their limits one by one and as one generation,
+    a rebalance of their per-CPU shares, and unsetting them all in one
+    iteration of the event loop. Creates the cgroups under
+    traffic-limitd-bench in the root of the hierarchy. Needs root.
+
+    tcbpf_util.c is included to reach its syscall counter and maps.
+*/
+#define _GNU_SOURCE
+#include "../src/tcbpf_util.c"
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#define BENCH_DIR "traffic-limitd-bench"
+#define BENCH_DEFAULT_NR_CGROUPS 1000
+
+static uint64_t now_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+struct bench_mark {
+    uint64_t nr_syscalls;
+    uint64_t ts;
+};
+
+static struct bench_mark bench_start(void){
+    return (struct bench_mark){.nr_syscalls = nr_bpf_syscalls, .ts = now_ns()};
+}
+
+static void bench_report(const char *what, const struct bench_mark *start, uint32_t nr_cgroups){
+    const uint64_t nr_syscalls = nr_bpf_syscalls - start->nr_syscalls;
+    printf("%-12s %6u cgroups %8lu bpf syscalls %8.3f per cgroup %10.1f us\n",
+        what, nr_cgroups, nr_syscalls, (double)nr_syscalls / nr_cgroups, (now_ns() - start->ts) / 1000.0);
+}
+
+static int bench_cgroups_create(int root_fd, uint64_t *cg_ids, uint32_t nr){
+    char path[64];
+    int rc = mkdirat(root_fd, BENCH_DIR, 0755);
+    if(rc < 0 && errno != EEXIST){
+        return -errno;
+    }
+    for(uint32_t i = 0; i < nr; i++){
+        snprintf(path, sizeof(path), BENCH_DIR "/cg%u", i);
+        rc = mkdirat(root_fd, path, 0755);
+        if(rc < 0 && errno != EEXIST){
+            return -errno;
+        }
+        rc = cg_path_get_cgroupid(path, &cg_ids[i]);
+        if(rc < 0){
+            return rc;
+        }
+    }
+    return 0;
+}
+
+static void bench_cgroups_remove(int root_fd, uint32_t nr){
+    char path[64];
+    for(uint32_t i = 0; i < nr; i++){
+        snprintf(path, sizeof(path), BENCH_DIR "/cg%u", i);
+        unlinkat(root_fd, path, AT_REMOVEDIR);
+    }
+    unlinkat(root_fd, BENCH_DIR, AT_REMOVEDIR);
+}
+
+/*
+    Give every cgroup a shard on each CPU as if it had sent, the BPF
+    program is not run, so that the rebalance has shares to update.
+*/
+static int bench_shards_fill(const uint64_t *cg_ids, uint32_t nr){
+    const size_t shard_size = nr_cpus * sizeof(struct rate_limit_shard);
+    struct rate_limit_shard *shards = calloc(nr, shard_size);
+    if(!shards){
+        return -ENOMEM;
+    }
+    for(uint32_t i = 0; i < nr; i++){
+        for(int cpu = 0; cpu < nr_cpus; cpu++){
+            shards[(size_t)i * nr_cpus + cpu].charged_ns = (uint64_t)(cpu + 1) * 1000000;
+        }
+    }
+    int rc = map_update_all(bpf_map__fd(cg_rl_skel->maps.rate_limit_shard_map), cg_ids, shards, shard_size, nr);
+    free(shards);
+    return rc;
+}
+
+static int bench_run(const uint64_t *cg_ids, uint32_t nr){
+    struct rate_limit_update *updates = calloc(nr, sizeof(struct rate_limit_update));
+    struct bench_mark start;
+    int rc = 0;
+    if(!updates){
+        return -ENOMEM;
+    }
+    for(uint32_t i = 0; i < nr; i++){
+        updates[i] = (struct rate_limit_update){
+            .cg_id = cg_ids[i],
+            .level = -1,
+            .limit = {
+                .byte_rate = 1000000,
+                .packet_rate = RATE_UNLIMITED,
+                // Every fourth cgroup has a quota, to count the maps only some cgroups are in
+                .quota_bytes = i % 4 == 0 ? 1000000000 : 0,
+                .flags = RATE_LIMIT_F_PERCPU,
+            },
+        };
+    }
+
+    start = bench_start();
+    for(uint32_t i = 0; i < nr; i++){
+        rc = cgroup_rate_limit_set(updates[i].cg_id, updates[i].level, &updates[i].limit);
+        if(rc < 0){
+            fprintf(stderr, "cgroup_rate_limit_set failed: %s\n", strerror(-rc));
+            goto out_free;
+        }
+    }
+    bench_report("set", &start, nr);
+
+    // Divide a new total rate among the same cgroups
+    for(uint32_t i = 0; i < nr; i++){
+        updates[i].limit.byte_rate = 2000000;
+    }
+    start = bench_start();
+    rc = cgroup_rate_limit_set_many(updates, nr);
+    if(rc < 0){
+        fprintf(stderr, "cgroup_rate_limit_set_many failed: %s\n", strerror(-rc));
+        goto out_free;
+    }
+    bench_report("set_many", &start, nr);
+
+    rc = bench_shards_fill(cg_ids, nr);
+    if(rc < 0){
+        fprintf(stderr, "bench_shards_fill failed: %s\n", strerror(-rc));
+        goto out_free;
+    }
+    // The first call only starts measuring the usage
+    cgroup_rate_limit_rebalance();
+    usleep(10000);
+    start = bench_start();
+    rc = cgroup_rate_limit_rebalance();
+    if(rc < 0){
+        fprintf(stderr, "cgroup_rate_limit_rebalance failed: %s\n", strerror(-rc));
+        goto out_free;
+    }
+    bench_report("rebalance", &start, nr);
+
+    start = bench_start();
+    for(uint32_t i = 0; i < nr; i++){
+        rc = cgroup_rate_limit_unset(cg_ids[i], -1);
+        if(rc < 0){
+            fprintf(stderr, "cgroup_rate_limit_unset failed: %s\n", strerror(-rc));
+            goto out_free;
+        }
+    }
+    rc = cgroup_rate_limit_flush();
+    if(rc < 0){
+        fprintf(stderr, "cgroup_rate_limit_flush failed: %s\n", strerror(-rc));
+        goto out_free;
+    }
+    bench_report("unset+flush", &start, nr);
+
+out_free:
+    free(updates);
+    return rc;
+}
+
+int main(int argc, char **argv){
+    const uint32_t nr = argc > 1 ? strtoul(argv[1], NULL, 10) : BENCH_DEFAULT_NR_CGROUPS;
+    uint64_t *cg_ids = NULL;
+    int root_fd = -1;
+    int rc = 0;
+
+    if(nr == 0){
+        fprintf(stderr, "usage: %s [number of cgroups]\n", argv[0]);
+        return 1;
+    }
+    log_set_level(LOG_WARN);
+    rc = cg_find_unified();
+    if(rc < 0){
+        fprintf(stderr, "cg_find_unified failed: %s\n", strerror(-rc));
+        return 1;
+    }
+    root_fd = cg_root_open();
+    if(root_fd < 0){
+        fprintf(stderr, "cg_root_open failed: %s\n", strerror(-root_fd));
+        return 1;
+    }
+    cg_ids = calloc(nr, sizeof(uint64_t));
+    if(!cg_ids){
+        rc = -ENOMEM;
+        goto out_close;
+    }
+    rc = bench_cgroups_create(root_fd, cg_ids, nr);
+    if(rc < 0){
+        fprintf(stderr, "bench_cgroups_create failed: %s\n", strerror(-rc));
+        goto out_remove;
+    }
+    rc = open_and_load_bpf_obj(nr, DATAPATH_ATTACH_TC, 0);
+    if(rc < 0){
+        fprintf(stderr, "open_and_load_bpf_obj failed: %s\n", strerror(-rc));
+        goto out_remove;
+    }
+    printf("%s, %d CPUs\n", use_cgrp_storage ? "cgroup local storage" : "hash maps", nr_cpus);
+    rc = bench_run(cg_ids, nr);
+    close_bpf_obj();
+
+out_remove:
+    bench_cgroups_remove(root_fd, nr);
+    free(cg_ids);
+out_close:
+    close(root_fd);
+    return rc < 0 ? 1 : 0;
+}
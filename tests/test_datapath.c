@@ -0,0 +1,448 @@
+/*
+    Tests of the BPF datapath, run through BPF_PROG_TEST_RUN. The kernel
+    charges test packets to a socket in the cgroup of the caller, so the
+    limits under test are set on the cgroup of this process. Needs root.
+
+    tcbpf_util.c is included to reach the loaded programs.
+*/
+#define _GNU_SOURCE
+#include "../src/tcbpf_util.c"
+
+#include <stdio.h>
+#include <pthread.h>
+#include <sched.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#define TEST_MAX_THREADS 4
+#define TEST_PKT_LEN 1000
+#define TEST_INGRESS_RATE 10000000
+#define TEST_CHILD_CGROUP "traffic-limitd-test"
+
+#define CHECK(cond, ...) do{ \
+    if(!(cond)){ \
+        fprintf(stderr, "%s:%d: check failed: %s: ", __FILE__, __LINE__, #cond); \
+        fprintf(stderr, __VA_ARGS__); \
+        fputc('\n', stderr); \
+        return -1; \
+    } \
+}while(0)
+
+static char own_cg_path[4096];
+static uint64_t own_cg_id = 0;
+static int own_level = -1;
+
+static uint64_t now_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+    Find the cgroup of this process in /proc/self/cgroup.
+*/
+static int own_cgroup(uint64_t *cg_id){
+    char line[sizeof(own_cg_path) + 3];
+    int rc = -ENOENT;
+    FILE *f = fopen("/proc/self/cgroup", "r");
+    if(!f){
+        return -errno;
+    }
+    while(fgets(line, sizeof(line), f)){
+        if(strncmp(line, "0::", 3)){
+            continue;
+        }
+        line[strcspn(line, "\n")] = '\0';
+        snprintf(own_cg_path, sizeof(own_cg_path), "%s", line + 3);
+        rc = cg_path_get_cgroupid(own_cg_path, cg_id);
+        break;
+    }
+    fclose(f);
+    return rc < 0 ? rc : 0;
+}
+
+// Move this process into the cgroup open as cg_fd
+static int cgroup_enter(int cg_fd){
+    const int fd = openat(cg_fd, "cgroup.procs", O_WRONLY|O_CLOEXEC);
+    if(fd < 0){
+        return -errno;
+    }
+    const int rc = write(fd, "0", 1) == 1 ? 0 : -errno;
+    close(fd);
+    return rc;
+}
+
+/*
+    An Ethernet frame of len bytes carrying UDP from saddr:sport to
+    daddr:dport, addresses in host byte order.
+*/
+static void build_udp4(uint8_t *buf, size_t len, uint32_t saddr, uint16_t sport, uint32_t daddr, uint16_t dport){
+    memset(buf, 0, len);
+    struct ethhdr *eth = (struct ethhdr *)buf;
+    eth->h_proto = htons(ETH_P_IP);
+    struct iphdr *ip = (struct iphdr *)(eth + 1);
+    ip->version = 4;
+    ip->ihl = 5;
+    ip->ttl = 64;
+    ip->protocol = IPPROTO_UDP;
+    ip->tot_len = htons(len - sizeof(*eth));
+    ip->saddr = htonl(saddr);
+    ip->daddr = htonl(daddr);
+    struct udphdr *udp = (struct udphdr *)(ip + 1);
+    udp->source = htons(sport);
+    udp->dest = htons(dport);
+    udp->len = htons(len - sizeof(*eth) - sizeof(*ip));
+}
+
+static int run_prog(const struct bpf_program *prog, void *pkt, size_t len, int repeat){
+    LIBBPF_OPTS(bpf_test_run_opts, opts,
+        .data_in = pkt,
+        .data_size_in = len,
+        .repeat = repeat,
+    );
+    int rc = bpf_prog_test_run_opts(bpf_program__fd(prog), &opts);
+    return rc < 0 ? -errno : 0;
+}
+
+struct stress_thread {
+    pthread_t thread;
+    int cpu;
+    int repeat;
+    int rc;
+};
+
+static void *stress_thread_fn(void *arg){
+    struct stress_thread *t = arg;
+    uint8_t pkt[TEST_PKT_LEN];
+    cpu_set_t cpus;
+
+    CPU_ZERO(&cpus);
+    CPU_SET(t->cpu, &cpus);
+    t->rc = -pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if(t->rc == 0){
+        build_udp4(pkt, sizeof(pkt), 0x7f000001, 40000 + t->cpu, 0x7f000001, 9);
+        t->rc = run_prog(datapath_prog, pkt, sizeof(pkt), t->repeat);
+    }
+    return NULL;
+}
+
+/*
+    Send from several CPUs at once, so that the reservations on the
+    shared timeline contend. Every reservation lies within the horizon,
+    so none may be dropped, and the timeline must end exactly the sum of
+    the delays after the departure of the first packet, which is known
+    within the run time of the test.
+*/
+static int test_reserve_stress(void){
+    const uint64_t byte_rate = 1000000;
+    const uint64_t delay_ns = TEST_PKT_LEN * 1000000000ull / byte_rate;
+    const struct rate_limit limit = {
+        .byte_rate = byte_rate,
+        .packet_rate = RATE_UNLIMITED,
+        .drop_horizon_ns = RATE_LIMIT_MAX_HORIZON_NS,
+    };
+    struct stress_thread threads[TEST_MAX_THREADS];
+    struct rate_limit_stats stats;
+    struct rate_limit_priv priv;
+    struct rate_limit cur_limit;
+    int nr_threads = nr_cpus < TEST_MAX_THREADS ? nr_cpus : TEST_MAX_THREADS;
+    // Keep the whole run inside the horizon
+    const int repeat = (RATE_LIMIT_MAX_HORIZON_NS / delay_ns) * 9 / 10 / nr_threads;
+    const uint64_t nr_packets = (uint64_t)repeat * nr_threads;
+
+    CHECK(cgroup_rate_limit_set(own_cg_id, own_level, &limit) == 0, "set");
+    const uint64_t t_before = now_ns();
+    for(int i = 0; i < nr_threads; i++){
+        threads[i].cpu = i;
+        threads[i].repeat = repeat;
+        CHECK(pthread_create(&threads[i].thread, NULL, stress_thread_fn, &threads[i]) == 0, "thread %d", i);
+    }
+    for(int i = 0; i < nr_threads; i++){
+        pthread_join(threads[i].thread, NULL);
+        CHECK(threads[i].rc == 0, "thread %d: %s", i, strerror(-threads[i].rc));
+    }
+    const uint64_t t_after = now_ns();
+
+    CHECK(cgroup_rate_limit_query(own_cg_id, &cur_limit, &priv) == 0, "query");
+    CHECK(cgroup_rate_limit_stats(own_cg_id, &stats) == 0, "stats");
+    CHECK(stats.passed_packets == nr_packets && stats.dropped_packets == 0,
+        "%llu passed, %llu dropped of %llu", stats.passed_packets, stats.dropped_packets, (unsigned long long)nr_packets);
+
+    const int64_t error_ns = (int64_t)(priv.next_avail_ts - t_before - nr_packets * delay_ns);
+    printf("reserve_ts: %llu packets on %d CPUs, timeline %+lld ns off the sum of delays, bound [0, %llu] ns\n",
+        (unsigned long long)nr_packets, nr_threads, (long long)error_ns, (unsigned long long)(t_after - t_before));
+    CHECK(error_ns >= 0 && (uint64_t)error_ns <= t_after - t_before, "timeline off by %lld ns", (long long)error_ns);
+    return 0;
+}
+
+/*
+    Packets dropped at the horizon must not be charged: with the
+    timeline far ahead, shrinking the horizon drops every packet and
+    leaves the timeline where it was.
+*/
+static int test_reserve_horizon(void){
+    const struct rate_limit limit = {
+        .byte_rate = 1000000,
+        .packet_rate = RATE_UNLIMITED,
+        .drop_horizon_ns = 1000000,
+    };
+    struct rate_limit_priv before, after;
+    struct rate_limit_stats stats_before, stats_after;
+    struct rate_limit cur_limit;
+    uint8_t pkt[TEST_PKT_LEN];
+
+    CHECK(cgroup_rate_limit_set(own_cg_id, own_level, &limit) == 0, "set");
+    CHECK(cgroup_rate_limit_query(own_cg_id, &cur_limit, &before) == 0, "query");
+    CHECK(before.next_avail_ts > now_ns() + 2 * limit.drop_horizon_ns, "timeline not ahead, run after test_reserve_stress");
+    CHECK(cgroup_rate_limit_stats(own_cg_id, &stats_before) == 0, "stats");
+    build_udp4(pkt, sizeof(pkt), 0x7f000001, 40000, 0x7f000001, 9);
+    CHECK(run_prog(datapath_prog, pkt, sizeof(pkt), 1000) == 0, "run");
+    CHECK(cgroup_rate_limit_query(own_cg_id, &cur_limit, &after) == 0, "query");
+    CHECK(cgroup_rate_limit_stats(own_cg_id, &stats_after) == 0, "stats");
+
+    CHECK(stats_after.dropped_packets - stats_before.dropped_packets == 1000, "%llu dropped",
+        stats_after.dropped_packets - stats_before.dropped_packets);
+    CHECK(after.next_avail_ts == before.next_avail_ts, "timeline moved by %lld ns",
+        (long long)(after.next_avail_ts - before.next_avail_ts));
+    return 0;
+}
+
+/*
+    In per-CPU mode each CPU paces at its share of the rate, so its
+    burst window must hold its share of the burst and not the whole
+    burst. Before the first rebalance every CPU has 1/nr_cpus.
+*/
+static int test_percpu_burst(void){
+    const uint64_t burst_pkts = 10;
+    const struct rate_limit limit = {
+        .byte_rate = 1000000,
+        .packet_rate = RATE_UNLIMITED,
+        .burst_bytes = burst_pkts * TEST_PKT_LEN * nr_cpus,
+        .drop_horizon_ns = RATE_LIMIT_MAX_HORIZON_NS,
+        .flags = RATE_LIMIT_F_PERCPU,
+    };
+    struct stress_thread thread = {.cpu = 0, .repeat = 100};
+    struct rate_limit_stats before, after;
+
+    CHECK(cgroup_rate_limit_set(own_cg_id, own_level, &limit) == 0, "set");
+    CHECK(cgroup_rate_limit_stats(own_cg_id, &before) == 0, "stats");
+    CHECK(pthread_create(&thread.thread, NULL, stress_thread_fn, &thread) == 0, "thread");
+    pthread_join(thread.thread, NULL);
+    CHECK(thread.rc == 0, "%s", strerror(-thread.rc));
+    CHECK(cgroup_rate_limit_stats(own_cg_id, &after) == 0, "stats");
+
+    const uint64_t passed = after.passed_packets - before.passed_packets;
+    const uint64_t undelayed = passed - (after.delayed_packets - before.delayed_packets);
+    printf("percpu burst: %llu of %llu packets sent without delay on one of %d CPUs\n",
+        (unsigned long long)undelayed, (unsigned long long)passed, nr_cpus);
+    CHECK(passed == (uint64_t)thread.repeat, "%llu passed", (unsigned long long)passed);
+    // The first packet starts the window, one more may fit as time passes
+    CHECK(undelayed >= burst_pkts + 1 && undelayed <= burst_pkts + 2, "%llu undelayed", (unsigned long long)undelayed);
+    return 0;
+}
+
+/*
+    Police packets received by a socket of the cgroup for about a
+    second, far faster than the ingress rate. The bucket starts full,
+    so the bytes passed must be the burst plus the rate times the
+    elapsed time, within one packet and 1%.
+*/
+static int check_ingress_accuracy(uint64_t ingress_burst_bytes, uint64_t expected_burst){
+    const struct rate_limit limit = {
+        .byte_rate = RATE_UNLIMITED,
+        .packet_rate = RATE_UNLIMITED,
+        .ingress_byte_rate = TEST_INGRESS_RATE,
+        .ingress_burst_bytes = ingress_burst_bytes,
+    };
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    socklen_t addr_len = sizeof(addr);
+    struct rate_limit_stats before, after;
+    struct rate_limit cur_limit;
+    struct rate_limit_priv priv;
+    uint8_t pkt[TEST_PKT_LEN];
+    int rc = 0;
+
+    CHECK(ingress_prog, "no ingress program");
+    // Start from a newly limited cgroup, with a full bucket
+    if(cgroup_rate_limit_query(own_cg_id, &cur_limit, &priv) == 0){
+        CHECK(cgroup_rate_limit_unset(own_cg_id, own_level) == 0, "unset");
+        CHECK(cgroup_rate_limit_flush() == 0, "flush");
+    }
+    CHECK(cgroup_rate_limit_set(own_cg_id, own_level, &limit) == 0, "set");
+    const int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    CHECK(fd >= 0, "socket: %s", strerror(errno));
+    rc = bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0 && getsockname(fd, (struct sockaddr *)&addr, &addr_len) == 0 ? 0 : -errno;
+    if(rc < 0){
+        close(fd);
+    }
+    CHECK(rc == 0, "bind: %s", strerror(-rc));
+    build_udp4(pkt, sizeof(pkt), INADDR_LOOPBACK, 40000, INADDR_LOOPBACK, ntohs(addr.sin_port));
+
+    rc = cgroup_rate_limit_stats(own_cg_id, &before);
+    const uint64_t t_before = now_ns();
+    uint64_t t_after = t_before;
+    while(rc == 0 && t_after - t_before < 1000000000ull){
+        rc = run_prog(ingress_prog, pkt, sizeof(pkt), 1000);
+        t_after = now_ns();
+    }
+    if(rc == 0){
+        rc = cgroup_rate_limit_stats(own_cg_id, &after);
+    }
+    close(fd);
+    CHECK(rc == 0, "%s", strerror(-rc));
+
+    const uint64_t passed = after.ingress_passed_bytes - before.ingress_passed_bytes;
+    const uint64_t dropped = after.ingress_dropped_bytes - before.ingress_dropped_bytes;
+    const uint64_t expected = expected_burst + TEST_INGRESS_RATE * (t_after - t_before) / 1000000000ull;
+    const int64_t error = (int64_t)(passed - expected);
+    printf("ingress: burst %llu, %llu bytes passed and %llu dropped in %llu ns, %+lld bytes off, bound %llu\n",
+        (unsigned long long)expected_burst, (unsigned long long)passed, (unsigned long long)dropped,
+        (unsigned long long)(t_after - t_before), (long long)error, (unsigned long long)(TEST_PKT_LEN + expected / 100));
+    CHECK(dropped > 0, "nothing dropped, packets not matched to the socket");
+    CHECK((uint64_t)llabs(error) <= TEST_PKT_LEN + expected / 100, "%+lld bytes off", (long long)error);
+    return 0;
+}
+
+// Without ingress_burst_bytes the bucket holds RATE_LIMIT_DEFAULT_POLICE_BURST_NS of the rate
+static int test_ingress_default_burst(void){
+    uint64_t burst = TEST_INGRESS_RATE * RATE_LIMIT_DEFAULT_POLICE_BURST_NS / 1000000000ull;
+    if(burst < RATE_LIMIT_MIN_POLICE_BURST){
+        burst = RATE_LIMIT_MIN_POLICE_BURST;
+    }
+    return check_ingress_accuracy(0, burst);
+}
+
+static int test_ingress_burst(void){
+    return check_ingress_accuracy(20000, 20000);
+}
+
+/*
+    Packets of a cgroup created below a limited one, as by a container
+    runtime inside a task, must be paced by the limit of the parent. The
+    child has no limit of its own, so its packets are only charged
+    through the walk up to the level of the parent.
+*/
+static int check_child_paced(void){
+    const uint64_t byte_rate = 1000000;
+    const struct rate_limit limit = {
+        .byte_rate = byte_rate,
+        .packet_rate = RATE_UNLIMITED,
+        .drop_horizon_ns = RATE_LIMIT_MAX_HORIZON_NS,
+    };
+    struct rate_limit_stats before, after;
+    struct rate_limit_priv priv;
+    struct rate_limit cur_limit;
+    uint8_t pkt[TEST_PKT_LEN];
+    const int repeat = 100;
+
+    CHECK(cgroup_rate_limit_set(own_cg_id, own_level, &limit) == 0, "set");
+    CHECK(cgroup_rate_limit_stats(own_cg_id, &before) == 0, "stats");
+    const uint64_t t_before = now_ns();
+    build_udp4(pkt, sizeof(pkt), 0x7f000001, 40000, 0x7f000001, 9);
+    CHECK(run_prog(datapath_prog, pkt, sizeof(pkt), repeat) == 0, "run");
+    CHECK(cgroup_rate_limit_stats(own_cg_id, &after) == 0, "stats");
+    CHECK(cgroup_rate_limit_query(own_cg_id, &cur_limit, &priv) == 0, "query");
+
+    const uint64_t passed = after.passed_packets - before.passed_packets;
+    const uint64_t delayed = after.delayed_packets - before.delayed_packets;
+    printf("child cgroup: %llu packets passed, %llu delayed by the limit of the parent\n",
+        (unsigned long long)passed, (unsigned long long)delayed);
+    CHECK(passed == (uint64_t)repeat, "%llu passed", (unsigned long long)passed);
+    // Only the first packet leaves at once
+    CHECK(delayed >= (uint64_t)repeat - 1, "%llu delayed", (unsigned long long)delayed);
+    CHECK(priv.next_avail_ts >= t_before + repeat * TEST_PKT_LEN * 1000000000ull / byte_rate, "timeline not charged");
+    return 0;
+}
+
+static int test_child_cgroup(void){
+    struct rate_limit cur_limit;
+    struct rate_limit_priv priv;
+    int rc = 0;
+
+    // Start from a newly limited cgroup, with an empty timeline
+    if(cgroup_rate_limit_query(own_cg_id, &cur_limit, &priv) == 0){
+        CHECK(cgroup_rate_limit_unset(own_cg_id, own_level) == 0, "unset");
+        CHECK(cgroup_rate_limit_flush() == 0, "flush");
+    }
+    const int own_fd = cg_self_open();
+    CHECK(own_fd >= 0, "cg_self_open: %s", strerror(-own_fd));
+    rc = mkdirat(own_fd, TEST_CHILD_CGROUP, 0755) == 0 || errno == EEXIST ? 0 : -errno;
+    const int child_fd = rc == 0 ? openat(own_fd, TEST_CHILD_CGROUP, O_RDONLY|O_DIRECTORY|O_CLOEXEC) : -1;
+    if(child_fd < 0){
+        rc = rc < 0 ? rc : -errno;
+        close(own_fd);
+    }
+    CHECK(rc == 0, "child cgroup: %s", strerror(-rc));
+    rc = cgroup_enter(child_fd);
+    if(rc == 0){
+        rc = check_child_paced();
+        const int leave_rc = cgroup_enter(own_fd);
+        if(leave_rc < 0){
+            fprintf(stderr, "leaving the child cgroup failed: %s\n", strerror(-leave_rc));
+            rc = leave_rc;
+        }
+    }else{
+        fprintf(stderr, "entering the child cgroup failed: %s\n", strerror(-rc));
+    }
+    close(child_fd);
+    unlinkat(own_fd, TEST_CHILD_CGROUP, AT_REMOVEDIR);
+    close(own_fd);
+    return rc;
+}
+
+static const struct {
+    const char *name;
+    int (*fn)(void);
+} tests[] = {
+    {"reserve_stress", test_reserve_stress},
+    {"reserve_horizon", test_reserve_horizon},
+    {"percpu_burst", test_percpu_burst},
+    {"ingress_default_burst", test_ingress_default_burst},
+    {"ingress_burst", test_ingress_burst},
+    {"child_cgroup", test_child_cgroup},
+};
+
+int main(void){
+    int rc = 0;
+    int nr_failed = 0;
+
+    log_set_level(LOG_WARN);
+    rc = cg_find_unified();
+    if(rc < 0){
+        fprintf(stderr, "cg_find_unified failed: %s\n", strerror(-rc));
+        return 1;
+    }
+    rc = own_cgroup(&own_cg_id);
+    if(rc < 0){
+        fprintf(stderr, "own_cgroup failed: %s\n", strerror(-rc));
+        return 1;
+    }
+    rc = open_and_load_bpf_obj(16, DATAPATH_ATTACH_TC, 0);
+    if(rc < 0){
+        fprintf(stderr, "open_and_load_bpf_obj failed: %s\n", strerror(-rc));
+        return 1;
+    }
+    own_level = cgroup_rate_limit_level(own_cg_id, own_cg_path);
+    if(own_level < 0){
+        fprintf(stderr, "cgroup_rate_limit_level failed: %s\n", strerror(-own_level));
+        close_bpf_obj();
+        return 1;
+    }
+
+    for(size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); i++){
+        rc = tests[i].fn();
+        printf("%s: %s\n", tests[i].name, rc < 0 ? "FAIL" : "ok");
+        nr_failed += rc < 0;
+    }
+
+    cgroup_rate_limit_unset(own_cg_id, own_level);
+    cgroup_rate_limit_flush();
+    close_bpf_obj();
+    return nr_failed ? 1 : 0;
+}